@@ -1,6 +1,7 @@
 /** \file App.cpp */
 #include "App.h"
 #include "PathTracer.h"
+#include "RenderService.h"
 
 // Tells C++ to invoke command-line main() function even on OS X and Win32.
 G3D_START_AT_MAIN();
@@ -14,6 +15,12 @@ int main(int argc, const char* argv[]) {
 
     GApp::Settings settings(argc, argv);
 
+    // "--serve" keeps the process alive as a render daemon fed by stdin (see RenderService)
+    bool serveMode = false;
+    for (int i = 1; i < argc; ++i) {
+        serveMode = serveMode || (String(argv[i]) == "--serve");
+    }
+
     // Change the window and other startup parameters by modifying the
     // settings class.  For example:
     settings.window.caption = argv[0];
@@ -43,11 +50,14 @@ int main(int argc, const char* argv[]) {
     settings.renderer.deferredShading = true;
     settings.renderer.orderIndependentTransparency = false;
 
-    return App(settings).run();
+    // The daemon still needs a GL context to load scenes, but never shows it
+    settings.window.visible = !serveMode;
+
+    return App(settings, serveMode).run();
 }
 
 
-App::App(const GApp::Settings& settings) : GApp(settings) {
+App::App(const GApp::Settings& settings, bool serveMode) : GApp(settings), m_serveMode(serveMode) {
 }
 
 
@@ -64,6 +74,12 @@ void App::onInit() {
 
     showRenderingStats = false;
 
+    if (m_serveMode) {
+        RenderService(m_ambientOcclusion).run();
+        setExitCode(0);
+        return;
+    }
+
     makeGUI();
     // For higher-quality screenshots:
     // developerWindow->videoRecordDialog->setScreenShotFormat("PNG");
@@ -256,19 +272,221 @@ void App::runSponzaTests() {
 
 }
 
-void App::onRender(shared_ptr<Image> &image) {
-    message("Rendering...");
+/// Compares one node against every detected node (or two simulated nodes on a single-socket machine),
+/// with and without a per-node copy of the tree
+void App::runNumaTests() {
+    scene()->load("G3D Sponza");
+    PathTracer tracer(scene());
+
+    NumaTopology detected;
+    const NumaTopology& topology = (detected.nodeCount() > 1) ? detected : NumaTopology(2);
+    const NumaTopology oneNode(1);
+
+    // The first replicated run includes building the per-node copies, the second reuses them
+    const struct { const NumaTopology* topology; bool replicateTree; const char* name; } runs[] = {
+        { &oneNode,  false, "1 node" },
+        { &topology, false, "all nodes, shared tree" },
+        { &topology, true,  "all nodes, building replicated trees" },
+        { &topology, true,  "all nodes, replicated trees" } };
+
+    for (int r = 0; r < 4; ++r) {
+        StopWatch stopWatch;
+        shared_ptr<Image> sponza = Image::create(640, 400, ImageFormat::RGB32F());
+        tracer.renderSceneNuma(sponza, stopWatch, *runs[r].topology, 16, 1, activeCamera(), runs[r].replicateTree);
+        debugPrintf("NUMA %s (%d nodes, %d processors): %fs\n", runs[r].name, runs[r].topology->nodeCount(),
+            runs[r].topology->totalProcessorCount(), stopWatch.elapsedTime());
+    }
+}
+
+/// Times the textured scenes with full resolution texture fetches against ray cone MIP selection
+void App::runTextureLodTests() {
+    const Array<String> sceneNames = { "G3D Sponza", "G3D San Miguel" };
 
-    StopWatch stopWatch;
-    PathTracer tracer = PathTracer(scene());
-    //tracer.setScene(scene());
-    //tracer.m_eyeRayTest = true;
-    tracer.renderScene(image, stopWatch, m_raysPerPixel, m_multiThreading, m_scatteringEvents,activeCamera());
+    for (int s = 0; s < sceneNames.size(); ++s) {
+        scene()->load(sceneNames[s]);
+        PathTracer tracer(scene());
+
+        for (int cones = 0; cones < 2; ++cones) {
+            tracer.m_rayCones = (cones == 1);
+
+            StopWatch stopWatch;
+            shared_ptr<Image> image = Image::create(640, 400, ImageFormat::RGB32F());
+            tracer.renderScene(image, stopWatch, 16, true, 2, scene()->defaultCamera());
+            processAndSaveImage(image, format("%s%s.png", sceneNames[s].c_str(), tracer.m_rayCones ? "Cones" : "FullRes"), stopWatch);
+        }
+    }
+}
+
+/// Compares the spp needed to reach the same noise with and without shadow rays to emissive triangles
+void App::runEmissiveTests() {
+    scene()->load("G3D Cornell Box");
+    PathTracer tracer(scene());
+
+    // Both settings must converge to the same mean, including with no bounces where the light sample carries full weight
+    const int scatterCounts[] = { 0, 2 };
+    for (int c = 0; c < 2; ++c) {
+        for (int sample = 0; sample < 2; ++sample) {
+            tracer.m_sampleEmissiveTris = (sample == 1);
+
+            StopWatch stopWatch;
+            shared_ptr<Image> image = Image::create(320, 200, ImageFormat::RGB32F());
+            const RenderStats& stats = tracer.renderScene(image, stopWatch, RenderBudget::noiseTarget(0.02f, 4096), true, scatterCounts[c], scene()->defaultCamera());
+
+            Radiance3 mean = Radiance3::zero();
+            for (int y = 0; y < image->height(); ++y) {
+                for (int x = 0; x < image->width(); ++x) {
+                    Color3 L;
+                    image->get(Point2int32(x, y), L);
+                    mean += L;
+                }
+            }
+            mean /= float(image->width() * image->height());
+
+            debugPrintf("Emissive triangle sampling %s, %d scatters: %d spp to reach error %f, mean radiance %s\n", tracer.m_sampleEmissiveTris ? "on" : "off",
+                scatterCounts[c], stats.raysPerPixel, stats.estimatedError, mean.toString().c_str());
+            processAndSaveImage(image, format("Emissive%s%d.png", tracer.m_sampleEmissiveTris ? "NEE" : "HitOnly", scatterCounts[c]), stopWatch);
+        }
+    }
+}
+
+void App::queueRender(const std::function<void()>& render) {
+    cancelRender();
+    m_pendingRender = render;
+}
+
+shared_ptr<PathTracer> App::prepareTracer() {
+    // Posing the scene and building the tree read the live scene, so they stay on the UI thread.
+    // setScene only rebuilds the tree if the geometry changed since the last render, and drops cached results
+    // itself when a material changed.
+    if (isNull(m_pathTracer)) {
+        m_pathTracer = std::make_shared<PathTracer>(scene());
+        m_pathTracer->m_keepLightContributions = true;
+    } else {
+        m_pathTracer->setScene(scene());
+    }
+    return m_pathTracer;
+}
+
+void App::onRender(const shared_ptr<Image>& image) {
+    // NUMA renders split the film into tiles that each take a fixed number of passes, so they cannot stop at a goal
+    if (m_numaAware && (m_budgetMode != RenderBudget::FIXED_SAMPLES)) {
+        msgBox("NUMA aware renders always take Rays Per Pixel samples. Set \"Stop at\" to \"Rays per pixel\" or turn off NUMA aware.", "Unsupported budget");
+        return;
+    }
+
+    // The render thread gets its own camera so moving the view cannot change rays mid-pass
+    const shared_ptr<PathTracer>& tracer = prepareTracer();
+    const shared_ptr<Camera>& camera = Camera::create("Render Camera");
+    camera->copyParametersFrom(activeCamera());
+
+    const int raysPerPixel = m_raysPerPixel;
+    RenderBudget budget = RenderBudget::fixedSamples(raysPerPixel);
+    if (m_budgetMode == RenderBudget::TIME_BUDGET) {
+        budget = RenderBudget::timeLimit(m_timeBudget);
+    } else if (m_budgetMode == RenderBudget::NOISE_TARGET) {
+        budget = RenderBudget::noiseTarget(m_targetError);
+    }
+    const int scatteringEvents = m_scatteringEvents;
+    const bool multithreading = m_multiThreading;
+    const bool numaAware = m_numaAware;
+
+    const shared_ptr<RenderJob>& job = std::make_shared<RenderJob>();
+    job->image = image;
+    job->filmSize = Vector2int32(image->width(), image->height());
+    job->cameraFrame = activeCamera()->frame();
+    job->budget = budget;
+    job->totalProgress = budget.raysPerPixel;
+    // NUMA renders are split into tiles that each take every pass, so they report tiles instead
+    job->progressUnit = numaAware ? "tiles" : "";
+    job->startTime = System::time();
+    job->lastPublishTime = job->startTime;
+
+    //tracer->m_eyeRayTest = true;
+    tracer->m_cancel = &job->cancel;
+    tracer->m_onPassComplete = [this, job, image](int passes, int totalPasses) {
+        publishPreview(job, image, passes, totalPasses);
+    };
+    tracer->m_onTileComplete = tracer->m_onPassComplete;
+
+    m_previewTexture.reset();
+    m_render = job;
+
+    job->thread = std::make_shared<std::thread>([=]() {
+        if (numaAware) {
+            tracer->renderSceneNuma(image, job->stopWatch, NumaTopology(), raysPerPixel, scatteringEvents, camera, true);
+            job->stats.raysPerPixel = raysPerPixel;
+        } else {
+            job->stats = tracer->renderScene(image, job->stopWatch, budget, multithreading, scatteringEvents, camera);
+        }
+        job->done = true;
+    });
+}
+
+void App::publishPreview(const shared_ptr<RenderJob>& job, const shared_ptr<Image>& image, int progress, int totalProgress) {
+    // Throttled so that copying the accumulation buffer stays negligible next to tracing.
+    // NUMA workers report concurrently, so the throttle is checked under the lock.
+    const RealTime now = System::time();
+    {
+        std::lock_guard<std::mutex> lock(job->previewMutex);
+        job->progress = max(job->progress, progress);
+        job->totalProgress = totalProgress;
+        job->elapsedTime = now - job->startTime;
+        if ((progress < totalProgress) && (now - job->lastPublishTime < PREVIEW_INTERVAL)) {
+            return;
+        }
+        job->lastPublishTime = now;
+    }
+
+    if (isNull(image)) {
+        return;
+    }
+
+    // In NUMA mode other workers may still be writing their tiles; the copy is only for display
+    const shared_ptr<PixelTransferBuffer>& buffer = image->toPixelTransferBuffer();
+
+    std::lock_guard<std::mutex> lock(job->previewMutex);
+    job->previewBuffer = buffer;
+}
+
+void App::cancelRender() {
+    m_pendingRender = nullptr;
+    if (isNull(m_render)) {
+        return;
+    }
+
+    // Joined by onSimulation once it has finished its pass, so the UI never waits on it
+    m_render->cancel = true;
+    m_cancelledRenders.append(m_render);
+    m_render.reset();
+    m_previewTexture.reset();
+}
+
+void App::finishRender() {
+    // The thread has already set done, so this does not block
+    const shared_ptr<RenderJob> job = m_render;
+    m_render.reset();
+    job->thread->join();
+    m_previewTexture.reset();
+
+    if (! job->error.empty()) {
+        debugPrintf("%s\n", job->error.c_str());
+        msgBox(job->error, "Render failed");
+        return;
+    }
+
+    if (isNull(job->image)) {
+        const String& caption = format("%s: %dx%d in %fs", job->filename.c_str(), job->filmSize.x, job->filmSize.y, job->stopWatch.elapsedTime());
+        debugPrintf("%s\n", caption.c_str());
+        message(caption);
+        return;
+    }
+
+    const shared_ptr<Image> image = job->image;
 
     // Show / save raw image 
     // Set window caption to amount of time rendering took (not including data structure initialization)
-    double time = stopWatch.elapsedTime();
-    const String& caption = format("Time: %fs", time);
+    double time = job->stopWatch.elapsedTime();
+    const String& caption = format("Time: %fs, %d spp, estimated error %.3f", time, job->stats.raysPerPixel, job->stats.estimatedError);
     debugPrintf("%s\n", caption.c_str());
     show(image, caption);
     image->convert(ImageFormat::RGB8());
@@ -290,20 +508,82 @@ void App::onRender(shared_ptr<Image> &image) {
      //m_film->exposeAndRender(rd, activeCamera()->filmSettings(), m_framebuffer->texture(0), settings().hdrFramebuffer.colorGuardBandThickness.x + settings().hdrFramebuffer.depthGuardBandThickness.x, settings().hdrFramebuffer.depthGuardBandThickness.x);
 }
 
+void App::onRenderToFile(const String& filename, int width, int height) {
+    // Each band is finished and written before the next starts, so there is no whole-film pass to stop after
+    if (m_budgetMode != RenderBudget::FIXED_SAMPLES) {
+        msgBox("Poster renders always take Rays Per Pixel samples. Set \"Stop at\" to \"Rays per pixel\".", "Unsupported budget");
+        return;
+    }
+
+    message("Rendering " + filename + "...");
+
+    const shared_ptr<PathTracer>& tracer = prepareTracer();
+    const shared_ptr<Camera>& camera = Camera::create("Render Camera");
+    camera->copyParametersFrom(activeCamera());
+
+    const int raysPerPixel = m_raysPerPixel;
+    const int scatteringEvents = m_scatteringEvents;
+    const bool multithreading = m_multiThreading;
+
+    const shared_ptr<RenderJob>& job = std::make_shared<RenderJob>();
+    job->filename = filename;
+    job->filmSize = Vector2int32(width, height);
+    job->cameraFrame = activeCamera()->frame();
+    job->budget = RenderBudget::fixedSamples(raysPerPixel);
+    job->progressUnit = "bands";
+    job->startTime = System::time();
+    job->lastPublishTime = job->startTime;
+
+    tracer->m_cancel = &job->cancel;
+    tracer->m_onPassComplete = nullptr;
+    tracer->m_onTileComplete = [this, job](int bands, int totalBands) {
+        publishPreview(job, nullptr, bands, totalBands);
+    };
+
+    m_previewTexture.reset();
+    m_render = job;
+
+    job->thread = std::make_shared<std::thread>([=]() {
+        try {
+            tracer->renderSceneToFile(filename, width, height, job->stopWatch, raysPerPixel, multithreading, scatteringEvents, camera);
+        } catch (const String& error) {
+            job->error = error;
+        }
+        job->done = true;
+    });
+}
+
 /// Adds gui pane to let the user create a height field from an image and specified xz and y scaling amounts
 void App::addRenderGUI() {
 
     shared_ptr<GuiWindow> renderWindow = GuiWindow::create("Render", debugWindow->theme(), Rect2D::xywh(1025, 175, 0, 50), GuiTheme::TOOL_WINDOW_STYLE);
     GuiPane* renderPane = renderWindow->pane();
 
-    Array<String> resolutionOptions = { "1x1", "320x200", "640x400" };
+    Array<String> resolutionOptions = { "1x1", "320x200", "640x400", "16384x8192 (to poster.pfm)" };
 
     renderPane->addDropDownList("Resolution", resolutionOptions, &m_resolutionChoice);
     renderPane->addNumberBox("Rays Per Pixel", &m_raysPerPixel, "", GuiTheme::LINEAR_SLIDER, 1, 2048, 1);
+
+    Array<String> budgetOptions = { "Rays per pixel", "Time budget", "Noise target" };
+    renderPane->addDropDownList("Stop at", budgetOptions, &m_budgetMode);
+    renderPane->addNumberBox("Time Budget", &m_timeBudget, "s", GuiTheme::LOG_SLIDER, 0.1f, 3600.0f);
+    renderPane->addNumberBox("Target Error", &m_targetError, "", GuiTheme::LOG_SLIDER, 0.001f, 0.5f);
     renderPane->addNumberBox("Scatters", &m_scatteringEvents, "", GuiTheme::LINEAR_SLIDER, 0, 2048, 1);
     renderPane->addCheckBox("Multithreading", &m_multiThreading);
+    renderPane->addCheckBox("NUMA aware", &m_numaAware);
+
+    renderPane->addButton("Cancel", [this]() {
+        cancelRender();
+    });
 
     renderPane->addButton("Render", [&]() {
+        // Poster sizes do not fit in memory, so they are streamed to disk band by band instead
+        if (m_resolutionChoice == 3) {
+            queueRender([this]() { onRenderToFile("poster.pfm", 16384, 8192); });
+            ArticulatedModel::clearCache();
+            return;
+        }
+
         shared_ptr<Image> image;
         try {
             switch (m_resolutionChoice) {
@@ -317,8 +597,9 @@ void App::addRenderGUI() {
         }
         catch (...) {
             msgBox("Unable to render the image.");
+            return;
         }
-        onRender(image);
+        queueRender([this, image]() { onRender(image); });
         //runSponzaTests();
 
         ArticulatedModel::clearCache();
@@ -419,9 +700,108 @@ void App::onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface> >& allSurface
 
 
 
+void App::onGraphics2D(RenderDevice* rd, Array<shared_ptr<Surface2D> >& posed2D) {
+    if (notNull(m_render)) {
+        const shared_ptr<RenderJob>& job = m_render;
+        shared_ptr<PixelTransferBuffer> buffer;
+        int progress, totalProgress;
+        RealTime elapsedTime;
+        {
+            std::lock_guard<std::mutex> lock(job->previewMutex);
+            buffer = job->previewBuffer;
+            job->previewBuffer.reset();
+            progress = job->progress;
+            totalProgress = job->totalProgress;
+            elapsedTime = job->elapsedTime;
+        }
+
+        // Only upload when the render thread has published something new
+        if (notNull(buffer)) {
+            m_previewTexture = Texture::fromPixelTransferBuffer("Preview", buffer);
+        }
+
+        rd->push2D(); {
+            const Point2 corner(10.0f, debugWindow->rect().y1() + 10.0f);
+            String status = "Rendering...";
+
+            if (notNull(m_previewTexture)) {
+                Draw::rect2D(Rect2D::xywh(corner, m_previewTexture->vector2Bounds()), rd, Color3::white(), m_previewTexture);
+            }
+
+            if (progress > 0) {
+                const float perSecond = float(progress / max(elapsedTime, 0.001));
+                const float eta = float(totalProgress - progress) / max(perSecond, 0.001f);
+                if (! job->progressUnit.empty()) {
+                    status = format("%d / %d %s   ETA %.0fs", progress, totalProgress, job->progressUnit.c_str(), eta);
+                } else {
+                    status = format("%d spp   %.1f spp/s", progress, perSecond);
+
+                    // A noise target has no predictable end
+                    if (job->budget.mode == RenderBudget::FIXED_SAMPLES) {
+                        status += format("   ETA %.0fs", eta);
+                    } else if (job->budget.mode == RenderBudget::TIME_BUDGET) {
+                        status += format("   ETA %.0fs", max(0.0, job->budget.seconds - elapsedTime));
+                    }
+                }
+            }
+
+            debugFont->draw2D(rd, status, corner + Vector2(0.0f, -2.0f), 12, Color3::white(), Color3::black(),
+                GFont::XALIGN_LEFT, GFont::YALIGN_BOTTOM);
+        } rd->pop2D();
+    }
+
+    GApp::onGraphics2D(rd, posed2D);
+}
+
+
+void App::onCleanup() {
+    // The only place that waits on render threads; they stop after their current pass
+    cancelRender();
+    for (int i = 0; i < m_cancelledRenders.size(); ++i) {
+        m_cancelledRenders[i]->thread->join();
+    }
+    m_cancelledRenders.clear();
+    GApp::onCleanup();
+}
+
+
 void App::onSimulation(RealTime rdt, SimTime sdt, SimTime idt) {
     GApp::onSimulation(rdt, sdt, idt);
 
+    const RealTime now = System::time();
+    const CFrame& cameraFrame = activeCamera()->frame();
+    if (cameraFrame != m_lastCameraFrame) {
+        m_lastCameraFrame = cameraFrame;
+        m_lastCameraMoveTime = now;
+    }
+
+    if (notNull(m_render)) {
+        if (m_render->done) {
+            finishRender();
+        } else if (notNull(m_render->image) && (cameraFrame != m_render->cameraFrame)) {
+            // The view moved, so the partial image is stale: restart at the same resolution once the camera settles.
+            // File renders keep their own camera and are not affected.
+            const Vector2int32 size = m_render->filmSize;
+            queueRender([this, size]() {
+                onRender(Image::create(size.x, size.y, ImageFormat::RGB32F()));
+            });
+        }
+    }
+
+    // Reap cancelled renders that have finished; their joins return immediately
+    for (int i = m_cancelledRenders.size() - 1; i >= 0; --i) {
+        if (m_cancelledRenders[i]->done) {
+            m_cancelledRenders[i]->thread->join();
+            m_cancelledRenders.fastRemove(i);
+        }
+    }
+
+    if (m_pendingRender && isNull(m_render) && (m_cancelledRenders.size() == 0) && (now - m_lastCameraMoveTime >= RESTART_DELAY)) {
+        const std::function<void()> render = m_pendingRender;
+        m_pendingRender = nullptr;
+        render();
+    }
+
     // Example GUI dynamic layout code.  Resize the debugWindow to fill
     // the screen horizontally.
     debugWindow->setRect(Rect2D::xywh(0, 0, (float)window()->width(), debugWindow->rect().height()));
@@ -6,6 +6,11 @@
  */
 #pragma once
 #include <G3D/G3DAll.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "PathTracer.h"
 
  /** \brief Application framework. */
 class App : public GApp {
@@ -13,18 +18,101 @@ protected:
 
     // Variables for render GUI
     bool m_multiThreading = true;
+    bool m_numaAware = false;
     int m_raysPerPixel = 1;
+
+    /** Index into RenderBudget::Mode. The time and error goals run to RenderBudget's default cap rather than
+        m_raysPerPixel, and are rejected for NUMA renders, which always take m_raysPerPixel. */
+    int m_budgetMode = RenderBudget::FIXED_SAMPLES;
+    float m_timeBudget = 10.0f;
+    float m_targetError = 0.02f;
     int m_scatteringEvents = 0;
     int m_resolutionChoice = 1;
 
 
     float m_gamma = 2.0f;
 
-    // Path tracer
-    //PathTracer m_pathTracer;
+    /** When true the app runs as a RenderService reading jobs from stdin instead of showing the GUI */
+    bool m_serveMode = false;
+
+    // Path tracer, kept between renders so unchanged geometry, primary hits and light contributions carry over
+    shared_ptr<PathTracer> m_pathTracer;
+
+    /** Minimum seconds between preview publications from the render thread */
+    const RealTime PREVIEW_INTERVAL = 0.25;
+
+    /** Seconds the camera must stay still before a render it made stale is restarted */
+    const RealTime RESTART_DELAY = 0.5;
+
+    /** One background render. Shared with its thread, so that a cancelled render can finish its current pass
+        on its own while the UI keeps running. Only the render thread touches image until done is set. */
+    struct RenderJob {
+        shared_ptr<std::thread> thread;
+        std::atomic<bool> cancel{ false };
+        std::atomic<bool> done{ false };
+
+        /** Null when the film is streamed to filename instead */
+        shared_ptr<Image> image;
+        String filename;
+        Vector2int32 filmSize;
+        CFrame cameraFrame;
+        RenderBudget budget;
+        Stopwatch stopWatch;
+        RealTime startTime = 0;
+
+        /** Written by the render thread before it sets done; error is empty on success */
+        RenderStats stats;
+        String error;
+
+        /** Latest progress from the render thread, guarded by previewMutex. progress counts passes, or the
+            pieces named by progressUnit ("tiles", "bands") for renders that are not progressive. */
+        std::mutex previewMutex;
+        RealTime lastPublishTime = 0;
+        shared_ptr<PixelTransferBuffer> previewBuffer;
+        int progress = 0;
+        int totalProgress = 0;
+        RealTime elapsedTime = 0;
+        String progressUnit;
+    };
+
+    shared_ptr<RenderJob> m_render;
+
+    /** Cancelled renders still finishing their last pass. They share m_pathTracer, so no render is started
+        until onSimulation has seen every one of them finish. */
+    Array<shared_ptr<RenderJob>> m_cancelledRenders;
+
+    /** Render requested by the GUI or by a camera move. Started by onSimulation once the cancelled renders
+        are done and the camera has been still for RESTART_DELAY. */
+    std::function<void()> m_pendingRender;
+    CFrame m_lastCameraFrame;
+    RealTime m_lastCameraMoveTime = 0;
+
+    /** UI thread copy of the last published preview */
+    shared_ptr<Texture> m_previewTexture;
+
+    /** Cancels the current render without waiting for it and queues render to start when it is safe */
+    void queueRender(const std::function<void()>& render);
+
+    /** Returns m_pathTracer updated to the current scene. Pre: no render thread is using it. */
+    shared_ptr<PathTracer> prepareTracer();
+
+    /** Starts ray tracing of image by the PathTracer class on a background thread and returns immediately;
+        progress is drawn by onGraphics2D and the result shown by finishRender. Called through queueRender. */
+    void onRender(const shared_ptr<Image>& image);
+
+    /** Called on the render thread(s) after every pass, tile or band. Records progress and copies image (if any)
+        for the UI at most every PREVIEW_INTERVAL. */
+    void publishPreview(const shared_ptr<RenderJob>& job, const shared_ptr<Image>& image, int progress, int totalProgress);
+
+    /** Asks the background render to stop after its current pass and returns without waiting for it */
+    void cancelRender();
+
+    /** Joins the finished render thread, then shows and saves the image or reports the file */
+    void finishRender();
 
-    /** Called by GUI to load a scene image. Invokes ray tracing performed by RayTracer class */
-    void onRender(shared_ptr<Image> &image);
+    /** Background render for films too large for memory. Streams the result to filename without building an
+        Image. Called through queueRender. */
+    void onRenderToFile(const String& filename, int width, int height);
 
     /** Called from onInit */
     void makeGUI();
@@ -36,15 +124,20 @@ protected:
     void runTests1();
     void runTests2();
     void runSponzaTests();
+    void runNumaTests();
+    void runTextureLodTests();
+    void runEmissiveTests();
     void processAndSaveImage(shared_ptr<Image> image, String name, Stopwatch watch);
 
 public:
 
-    App(const GApp::Settings& settings = GApp::Settings());
+    App(const GApp::Settings& settings = GApp::Settings(), bool serveMode = false);
 
     virtual void onInit() override;
     void onAfterLoadScene(const Any & any, const String & sceneName);
     virtual void onSimulation(RealTime rdt, SimTime sdt, SimTime idt) override;
 
     virtual void onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface> >& surface3D) override;
+    virtual void onGraphics2D(RenderDevice* rd, Array<shared_ptr<Surface2D> >& surface2D) override;
+    virtual void onCleanup() override;
 };
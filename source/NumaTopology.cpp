@@ -0,0 +1,116 @@
+#include "NumaTopology.h"
+
+#ifdef G3D_WINDOWS
+#   include <windows.h>
+#elif defined(G3D_LINUX)
+#   include <sched.h>
+#   include <fstream>
+#endif
+
+
+NumaTopology::NumaTopology(int simulatedNodeCount) {
+    detect();
+
+    if (simulatedNodeCount > 0) {
+        Array<int> all;
+        for (int n = 0; n < m_nodeProcessors.size(); ++n) {
+            all.append(m_nodeProcessors[n]);
+        }
+
+        // Split evenly into contiguous processor ranges, never producing an empty node
+        const int nodes = min(simulatedNodeCount, all.size());
+        m_nodeProcessors.clear();
+        m_nodeProcessors.resize(nodes);
+        for (int i = 0; i < all.size(); ++i) {
+            m_nodeProcessors[i * nodes / all.size()].append(all[i]);
+        }
+    }
+}
+
+int NumaTopology::totalProcessorCount() const {
+    int total = 0;
+    for (int n = 0; n < m_nodeProcessors.size(); ++n) {
+        total += m_nodeProcessors[n].size();
+    }
+    return total;
+}
+
+void NumaTopology::detect() {
+    m_nodeProcessors.clear();
+
+#ifdef G3D_WINDOWS
+    ULONG highestNode = 0;
+    if (GetNumaHighestNodeNumber(&highestNode)) {
+        for (USHORT node = 0; node <= highestNode; ++node) {
+            GROUP_AFFINITY affinity;
+            if (GetNumaNodeProcessorMaskEx(node, &affinity) && (affinity.Mask != 0)) {
+                Array<int>& processors = m_nodeProcessors.next();
+                for (int bit = 0; bit < 64; ++bit) {
+                    if (affinity.Mask & (KAFFINITY(1) << bit)) {
+                        processors.append(affinity.Group * 64 + bit);
+                    }
+                }
+            }
+        }
+    }
+#elif defined(G3D_LINUX)
+    // Each node directory lists its processors as ranges, e.g. "0-7,16-23"
+    for (int node = 0; FileSystem::exists(format("/sys/devices/system/node/node%d", node)); ++node) {
+        // sysfs reports every file as 4096 bytes, so read the line itself rather than trusting the file size
+        std::ifstream file(format("/sys/devices/system/node/node%d/cpulist", node).c_str());
+        std::string line;
+        std::getline(file, line);
+        const String& cpuList = trimWhitespace(String(line.c_str()));
+        Array<int>& processors = m_nodeProcessors.next();
+
+        const Array<String>& ranges = stringSplit(cpuList, ',');
+        for (int r = 0; r < ranges.size(); ++r) {
+            const Array<String>& bounds = stringSplit(ranges[r], '-');
+            if (bounds[0].empty()) {
+                continue;
+            }
+            const int first = atoi(bounds[0].c_str());
+            const int last = (bounds.size() > 1) ? atoi(bounds[1].c_str()) : first;
+            for (int cpu = first; cpu <= last; ++cpu) {
+                processors.append(cpu);
+            }
+        }
+
+        if (processors.size() == 0) {
+            // Memory-only node
+            m_nodeProcessors.pop();
+        }
+    }
+#endif
+
+    if (m_nodeProcessors.size() == 0) {
+        Array<int>& processors = m_nodeProcessors.next();
+        for (int cpu = 0; cpu < System::numCores(); ++cpu) {
+            processors.append(cpu);
+        }
+    }
+}
+
+void NumaTopology::pinCurrentThread(int node) const {
+    const Array<int>& processors = m_nodeProcessors[node];
+
+#ifdef G3D_WINDOWS
+    // A node never spans processor groups, so the group of the first processor is the group of all of them
+    GROUP_AFFINITY affinity;
+    memset(&affinity, 0, sizeof(affinity));
+    affinity.Group = WORD(processors[0] / 64);
+    for (int i = 0; i < processors.size(); ++i) {
+        affinity.Mask |= KAFFINITY(1) << (processors[i] % 64);
+    }
+    SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+#elif defined(G3D_LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < processors.size(); ++i) {
+        CPU_SET(processors[i], &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#else
+    (void)processors;
+#endif
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/**
+    Describes which logical processors belong to which NUMA node and pins threads to nodes.
+    On a single-socket machine a node split can be simulated to exercise the NUMA code paths.
+*/
+
+class NumaTopology {
+protected:
+
+    /** Logical processor indices for each node. On Windows the index is group * 64 + processor within group. */
+    Array<Array<int>> m_nodeProcessors;
+
+    /** Fills m_nodeProcessors from the operating system, falling back to one node holding every processor */
+    void detect();
+
+public:
+
+    /** Constructor. If simulatedNodeCount > 0 the processors are instead split evenly into that many nodes */
+    NumaTopology(int simulatedNodeCount = 0);
+
+    int nodeCount() const {
+        return m_nodeProcessors.size();
+    }
+
+    int processorCount(int node) const {
+        return m_nodeProcessors[node].size();
+    }
+
+    int totalProcessorCount() const;
+
+    /** Restricts the calling thread to the processors of node. Memory it touches first is then allocated on that node. */
+    void pinCurrentThread(int node) const;
+};
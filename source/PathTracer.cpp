@@ -1,5 +1,7 @@
 #include "PathTracer.h"
 #include "App.h"
+#include <algorithm>
+#include <thread>
 
 
 /** constructs TriTree object used in PathTracer::intersectRay and PathTracer::triangleIntersect */
@@ -10,98 +12,661 @@ PathTracer::PathTracer(shared_ptr<Scene> scene) {
 }
 
 void PathTracer::setScene(shared_ptr<Scene> scene) {
-    m_scene = scene;
+    const RealTime start = System::time();
 
     Array<shared_ptr<Surface>> surfaces;
-    m_scene->onPose(surfaces);
-    m_tris.setContents(surfaces);
+    scene->onPose(surfaces);
+
+    // Building the tree is the expensive part, so keep it when only lights or the camera changed.
+    // Hashing the vertices costs far less than a rebuild and is the only way to see deformation in place.
+    uint32 geometryHash = 0;
+    const bool verifiable = hashGeometry(surfaces, geometryHash);
+    const bool keepTree = (scene == m_scene) && (scene->lastStructuralChangeTime() == m_lastStructuralChangeTime) &&
+        verifiable && (geometryHash == m_geometryHash) && sameGeometry(surfaces);
+
+    m_scene = scene;
+    m_lights.fastClear();
+    m_scene->getTypedEntityArray(m_lights);
+
+    if (! keepTree) {
+        m_surfaces = surfaces;
+        m_tris.setContents(m_surfaces);
+        m_lastStructuralChangeTime = m_scene->lastStructuralChangeTime();
+        m_geometryHash = geometryHash;
+        m_nodeTris.clear();
+    }
+
+    // Materials can be edited in place without changing the geometry. Cached primary surfels hold samples of
+    // the old material, so any difference, or a material that cannot be described, drops them.
+    const String& materials = materialState(m_surfaces);
+    if (! keepTree || materials.empty() || (materials != m_materialState)) {
+        m_materialState = materials;
+        buildEmissiveTris();
+        m_cache = RenderCache();
+    }
+    m_lastTreeBuildTime = System::time() - start;
    
 }
 
+/** Describes a material component by its range, mean and texture, which is what surfels sample */
+template<class C>
+static String componentState(const C& component) {
+    return format("%s %s %s %p;", component.min().toString().c_str(), component.mean().toString().c_str(),
+        component.max().toString().c_str(), component.texture().get());
+}
+
+String PathTracer::materialState(const Array<shared_ptr<Surface>>& surfaces) {
+    String state;
+    for (int s = 0; s < surfaces.size(); ++s) {
+        const shared_ptr<UniversalSurface>& surface = dynamic_pointer_cast<UniversalSurface>(surfaces[s]);
+        if (isNull(surface) || isNull(surface->material()) || isNull(surface->material()->bsdf())) {
+            return "";
+        }
+
+        const shared_ptr<UniversalMaterial>& material = surface->material();
+        const shared_ptr<UniversalBSDF>& bsdf = material->bsdf();
+        state += format("%p %p %p ", material.get(), bsdf.get(), material->bump().get()) +
+            componentState(bsdf->lambertian()) + componentState(bsdf->glossy()) + componentState(bsdf->transmissive()) +
+            componentState(material->emissive()) +
+            format("%f %f %s %s\n", bsdf->etaTransmit(), bsdf->etaReflect(), bsdf->extinctionTransmit().toString().c_str(), bsdf->extinctionReflect().toString().c_str());
+    }
+    return state;
+}
+
+String PathTracer::lightState(const shared_ptr<Light>& light) {
+    Any any = light->toAny(true);
+    if (any.type() != Any::TABLE) {
+        return "";
+    }
+
+    // The two settings a relight can apply
+    const char* relightable[] = { "bulbPower", "enabled" };
+    for (int k = 0; k < 2; ++k) {
+        if (any.containsKey(relightable[k])) {
+            any.remove(relightable[k]);
+        }
+    }
+    return any.unparse();
+}
+
+bool PathTracer::sameGeometry(const Array<shared_ptr<Surface>>& surfaces) const {
+    if (surfaces.size() != m_surfaces.size()) {
+        return false;
+    }
+
+    for (int s = 0; s < surfaces.size(); ++s) {
+        CFrame frame, oldFrame;
+        surfaces[s]->getCoordinateFrame(frame);
+        m_surfaces[s]->getCoordinateFrame(oldFrame);
+        if ((surfaces[s]->name() != m_surfaces[s]->name()) || (frame != oldFrame)) {
+            return false;
+        }
+
+        // The tree's triangles point at their materials, so a reassigned material needs a new tree
+        const shared_ptr<UniversalSurface>& surface = dynamic_pointer_cast<UniversalSurface>(surfaces[s]);
+        const shared_ptr<UniversalSurface>& oldSurface = dynamic_pointer_cast<UniversalSurface>(m_surfaces[s]);
+        if (notNull(surface) && notNull(oldSurface) && (surface->material() != oldSurface->material())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PathTracer::hashGeometry(const Array<shared_ptr<Surface>>& surfaces, uint32& hash) {
+    hash = 0;
+
+    // Many surfaces index into one shared vertex array, so each array is hashed once
+    Table<const CPUVertexArray*, uint32> vertexHashes;
+    for (int s = 0; s < surfaces.size(); ++s) {
+        const shared_ptr<UniversalSurface>& surface = dynamic_pointer_cast<UniversalSurface>(surfaces[s]);
+        if (isNull(surface) || isNull(surface->cpuGeom().vertexArray) || isNull(surface->cpuGeom().index)) {
+            return false;
+        }
+
+        const CPUVertexArray* vertexArray = surface->cpuGeom().vertexArray;
+        const Array<int>& index = *surface->cpuGeom().index;
+        if (! vertexHashes.containsKey(vertexArray)) {
+            const Array<CPUVertexArray::Vertex>& vertex = vertexArray->vertex;
+            vertexHashes.set(vertexArray, superFastHash(vertex.getCArray(), vertex.size() * sizeof(CPUVertexArray::Vertex)));
+        }
+
+        hash = hash * 31 + vertexHashes[vertexArray];
+        hash = hash * 31 + superFastHash(index.getCArray(), index.size() * sizeof(int));
+    }
+    return true;
+}
+
+Power3 PathTracer::effectivePower(const shared_ptr<Light>& light) {
+    return light->enabled() ? light->bulbPower() : Power3::zero();
+}
+
+bool PathTracer::relightScales(Array<Color3>& scale) const {
+    if (! m_cache.imageValid || (m_cache.lights.size() != m_lights.size()) || (m_cache.lightSums.size() != m_lights.size() * m_cache.image.size())) {
+        return false;
+    }
+
+    scale.resize(m_lights.size());
+    for (int j = 0; j < m_lights.size(); ++j) {
+        if ((m_lights[j] != m_cache.lights[j]) || (m_lights[j]->frame() != m_cache.lightFrames[j])) {
+            return false;
+        }
+
+        // Spot angle, attenuation, shadowing etc. change the image in ways a rescale cannot reproduce
+        const String& state = lightState(m_lights[j]);
+        if (state.empty() || (state != m_cache.lightStates[j])) {
+            return false;
+        }
+
+        const Power3& oldPower = m_cache.lightPowers[j];
+        const Power3& newPower = effectivePower(m_lights[j]);
+        for (int c = 0; c < 3; ++c) {
+            if (oldPower[c] > 0.0f) {
+                scale[j][c] = newPower[c] / oldPower[c];
+            } else if (newPower[c] > 0.0f) {
+                // Nothing was traced for a channel that was dark
+                return false;
+            } else {
+                scale[j][c] = 0.0f;
+            }
+        }
+    }
+    return true;
+}
+
+void PathTracer::relight(const shared_ptr<Image>& image, const Array<Color3>& scale, bool multithreading) {
+    const int numPixels = m_cache.image.size();
+    const int width = m_cache.filmSize.x;
+    const float passes = float(m_cache.stats.raysPerPixel);
+
+    Thread::runConcurrently(G3D::Point2int32(0, 0), G3D::Point2int32(width, m_cache.filmSize.y), [&](G3D::Point2int32 coord) {
+        const int i = coord.y * width + coord.x;
+        for (int j = 0; j < scale.size(); ++j) {
+            Radiance3& sum = m_cache.lightSums[j * numPixels + i];
+            m_cache.image[i] += sum * (scale[j] - Color3::one()) / passes;
+            sum *= scale[j];
+        }
+        image->set(coord, m_cache.image[i]);
+    }, !multithreading);
+
+    for (int j = 0; j < m_lights.size(); ++j) {
+        m_cache.lightPowers[j] = effectivePower(m_lights[j]);
+    }
+}
+
+bool PathTracer::sampledAsEmitter(const Material* material) {
+    const UniversalMaterial* universal = dynamic_cast<const UniversalMaterial*>(material);
+    if (isNull(universal)) {
+        return false;
+    }
+    const Component3& emissive = universal->emissive();
+    return (emissive.mean().average() > 0.0f) && (emissive.min() == emissive.max());
+}
+
+void PathTracer::buildEmissiveTris() {
+    m_emissiveTris.fastClear();
+    m_emissiveCDF.fastClear();
+    m_totalEmissivePower = 0.0f;
+
+    const CPUVertexArray& vertexArray = m_tris.vertexArray();
+    for (int t = 0; t < m_tris.size(); ++t) {
+        const Tri& tri = m_tris[t];
+        if (! sampledAsEmitter(tri.material().get()) || (tri.area() <= 0.0f)) {
+            continue;
+        }
+        const shared_ptr<UniversalMaterial>& material = dynamic_pointer_cast<UniversalMaterial>(tri.material());
+
+        EmissiveTri& emitter = m_emissiveTris.next();
+        for (int v = 0; v < 3; ++v) {
+            emitter.vertex[v] = tri.position(vertexArray, v);
+        }
+        emitter.normal = tri.normal(vertexArray);
+        emitter.area = tri.area();
+        emitter.radiance = material->emissive().mean();
+
+        m_totalEmissivePower += emitter.area * emitter.radiance.average();
+        m_emissiveCDF.append(m_totalEmissivePower);
+    }
+
+    for (int t = 0; t < m_emissiveCDF.size(); ++t) {
+        m_emissiveCDF[t] /= m_totalEmissivePower;
+    }
+}
+
 void PathTracer::renderScene(const shared_ptr<Image>& image, Stopwatch& stopWatch, int raysPerPixel, bool multithreading, int scatteringEvents, shared_ptr<Camera> camera) {
+    renderScene(image, stopWatch, RenderBudget::fixedSamples(raysPerPixel), multithreading, scatteringEvents, camera);
+}
+
+RenderStats PathTracer::renderScene(const shared_ptr<Image>& image, Stopwatch& stopWatch, const RenderBudget& budget, bool multithreading, int scatteringEvents, shared_ptr<Camera> camera) {
 
     m_camera=camera;
 
+    // Start timing the actual rendering process (so dont take time to build data structures into account)
+    stopWatch.tick();
 
-    // Grab light array for the scene
-    Array<shared_ptr<Light>> lightArray;
-    m_scene->getTypedEntityArray(lightArray);
+    // Anything cached for another view is useless
+    const Vector2int32 filmSize(image->width(), image->height());
+    if ((m_cache.filmSize != filmSize) || (m_cache.cameraFrame != m_camera->frame()) ||
+        (m_cache.fieldOfView != m_camera->fieldOfViewAngle()) || (m_cache.rayCones != m_rayCones)) {
+        m_cache = RenderCache();
+        m_cache.filmSize = filmSize;
+        m_cache.cameraFrame = m_camera->frame();
+        m_cache.fieldOfView = m_camera->fieldOfViewAngle();
+        m_cache.rayCones = m_rayCones;
+    }
+
+    const bool debugView = m_eyeRayTest || m_hitsTest || m_geoNormalsTest;
+    const bool sameSettings = (m_cache.scatteringEvents == scatteringEvents) && (m_cache.budget == budget) && (m_cache.sampleEmissiveTris == m_sampleEmissiveTris);
+
+    Array<Color3> scale;
+    RenderStats stats;
+    if (! debugView && sameSettings && relightScales(scale)) {
+        // Only light power or color changed since the last render
+        relight(image, scale, multithreading);
+        stats = m_cache.stats;
+    } else {
+        m_cache.imageValid = false;
+        m_cache.scatteringEvents = scatteringEvents;
+        m_cache.budget = budget;
+        m_cache.sampleEmissiveTris = m_sampleEmissiveTris;
+        stats = renderTile(m_tris, image, Point2int32(0, 0), filmSize, budget, multithreading, scatteringEvents, &m_cache);
+    }
+
+    stopWatch.tock();
+    stats.time = stopWatch.elapsedTime();
+
+    const String& caption = format("%i rays per pixel, estimated error %f, %fs", stats.raysPerPixel, stats.estimatedError, stats.time);
+    debugPrintf("%s\n", caption.c_str());
+    return stats;
+}
+
+bool PathTracer::renderSceneToFile(const String& filename, int width, int height, Stopwatch& stopWatch, int raysPerPixel, bool multithreading, int scatteringEvents, shared_ptr<Camera> camera, int bandHeight) {
+
+    m_camera=camera;
+
+    FILE* file = FileSystem::fopen(filename.c_str(), "wb");
+    if (isNull(file)) {
+        throw "Unable to open " + filename + " for writing";
+    }
+
+    // Running out of disk is the expected way for a poster render to fail, so every write is checked
+    // and a partial file is never left behind looking like a finished image
+    const auto& fail = [&](const String& reason) {
+        fclose(file);
+        FileSystem::removeFile(filename);
+        throw reason + " while writing " + filename;
+    };
+
+    // PFM header; a negative scale means little-endian floats. Rows are stored bottom to top,
+    // so the bands are rendered from the bottom of the film upwards and appended as they finish.
+    if (fprintf(file, "PF\n%d %d\n-1.0\n", width, height) < 0) {
+        fail("Unable to write the header");
+    }
 
-    // Start timing the actual rendering process (so dont take time to build data structures into account)
     stopWatch.tick();
 
-    const int height = image->height();
+    const Vector2int32 filmSize(width, height);
+    Array<float> row;
+    row.resize(width * 3);
+
+    const int bandCount = iCeil(float(height) / float(bandHeight));
+    for (int bandEnd = height, bandIndex = 0; bandEnd > 0; bandEnd -= bandHeight, ++bandIndex) {
+        if (notNull(m_cancel) && m_cancel->load()) {
+            fclose(file);
+            FileSystem::removeFile(filename);
+            stopWatch.tock();
+            return false;
+        }
+
+        const int bandStart = max(0, bandEnd - bandHeight);
+        const String& caption = format("Band: rows %i to %i of %i", bandStart, bandEnd - 1, height);
+        debugPrintf("%s\n", caption.c_str());
+
+        // Only this band is resident; it is released when it goes out of scope
+        const shared_ptr<Image>& band = Image::create(width, bandEnd - bandStart, ImageFormat::RGB32F());
+        renderTile(m_tris, band, Point2int32(0, bandStart), filmSize, RenderBudget::fixedSamples(raysPerPixel), multithreading, scatteringEvents);
+
+        for (int y = band->height() - 1; y >= 0; --y) {
+            for (int x = 0; x < width; ++x) {
+                Color3 c;
+                band->get(Point2int32(x, y), c);
+                row[3 * x] = c.r;
+                row[3 * x + 1] = c.g;
+                row[3 * x + 2] = c.b;
+            }
+            if (fwrite(row.getCArray(), sizeof(float), row.size(), file) != size_t(row.size())) {
+                fail(format("Out of disk space at row %d", y + bandStart));
+            }
+        }
+
+        if (m_onTileComplete) {
+            m_onTileComplete(bandIndex + 1, bandCount);
+        }
+    }
+
+    // fclose flushes the last buffered rows, so it can fail for the same reason
+    if (fclose(file) != 0) {
+        FileSystem::removeFile(filename);
+        throw "Unable to finish writing " + filename;
+    }
+    stopWatch.tock();
+    return true;
+}
+
+void PathTracer::renderSceneNuma(const shared_ptr<Image>& image, Stopwatch& stopWatch, const NumaTopology& topology, int raysPerPixel, int scatteringEvents, shared_ptr<Camera> camera, bool replicateTree, int tileSize) {
+
+    m_camera=camera;
+
+    const int nodeCount = topology.nodeCount();
     const int width = image->width();
+    const int height = image->height();
+    const Vector2int32 filmSize(width, height);
+
+    stopWatch.tick();
+
+    // Build the per-node trees on threads pinned to each node so their nodes are allocated there. The copies are
+    // kept for later renders. They are built one at a time because setContents walks the shared surfaces and materials.
+    const bool replicated = replicateTree && (nodeCount > 1);
+    if (replicated && (m_nodeTris.size() != nodeCount)) {
+        m_nodeTris.clear();
+        for (int node = 0; node < nodeCount; ++node) {
+            if (notNull(m_cancel) && m_cancel->load()) {
+                m_nodeTris.clear();
+                stopWatch.tock();
+                return;
+            }
+
+            std::thread builder([&, node]() {
+                topology.pinCurrentThread(node);
+                const shared_ptr<TriTree>& tris = std::make_shared<TriTree>();
+                tris->setContents(m_surfaces);
+                m_nodeTris.append(tris);
+            });
+            builder.join();
+        }
+    }
+
+    // Give each node a contiguous band of tile rows proportional to its share of the processors
+    const int tileRows = iCeil(float(height) / float(tileSize));
+    const int tileCols = iCeil(float(width) / float(tileSize));
+    Array<int> firstTileRow;
+    firstTileRow.resize(nodeCount + 1);
+    int processorsBefore = 0;
+    for (int node = 0; node <= nodeCount; ++node) {
+        firstTileRow[node] = tileRows * processorsBefore / topology.totalProcessorCount();
+        if (node < nodeCount) {
+            processorsBefore += topology.processorCount(node);
+        }
+    }
+
+    Array<shared_ptr<std::atomic<int>>> nextTile;
+    Array<shared_ptr<std::thread>> workers;
+    std::atomic<int> tilesDone(0);
+    const int tileCount = tileRows * tileCols;
+    for (int node = 0; node < nodeCount; ++node) {
+        nextTile.append(std::make_shared<std::atomic<int>>(firstTileRow[node] * tileCols));
+    }
+
+    for (int node = 0; node < nodeCount; ++node) {
+        const TriTree* tris = replicated ? m_nodeTris[node].get() : &m_tris;
+        const int endTile = firstTileRow[node + 1] * tileCols;
+
+        for (int p = 0; p < topology.processorCount(node); ++p) {
+            workers.append(std::make_shared<std::thread>([&, node, endTile, tris]() {
+                topology.pinCurrentThread(node);
+
+                // A cancelled render stops handing out tiles; the tiles in flight finish their current pass
+                for (int t = (*nextTile[node])++; (t < endTile) && ! (notNull(m_cancel) && m_cancel->load()); t = (*nextTile[node])++) {
+                    const Point2int32 offset((t % tileCols) * tileSize, (t / tileCols) * tileSize);
+                    const int tileWidth = min(tileSize, width - offset.x);
+                    const int tileHeight = min(tileSize, height - offset.y);
+
+                    // Allocated and first touched by this pinned thread, so local to the node
+                    const shared_ptr<Image>& tile = Image::create(tileWidth, tileHeight, ImageFormat::RGB32F());
+                    renderTile(*tris, tile, offset, filmSize, RenderBudget::fixedSamples(raysPerPixel), false, scatteringEvents);
+
+                    for (int y = 0; y < tileHeight; ++y) {
+                        for (int x = 0; x < tileWidth; ++x) {
+                            Color3 c;
+                            tile->get(Point2int32(x, y), c);
+                            image->increment(offset + Point2int32(x, y), c);
+                        }
+                    }
+
+                    if (m_onTileComplete) {
+                        m_onTileComplete(++tilesDone, tileCount);
+                    }
+                }
+            }));
+        }
+    }
+
+    for (int w = 0; w < workers.size(); ++w) {
+        workers[w]->join();
+    }
+
+    stopWatch.tock();
+}
+
+RenderStats PathTracer::renderTile(const TriTree& tris, const shared_ptr<Image>& tile, const Point2int32& tileOffset, const Vector2int32& filmSize, const RenderBudget& budget, bool multithreading, int scatteringEvents, RenderCache* cache) {
+
+    const Array<shared_ptr<Light>>& lightArray = m_lights;
+
+    const int height = tile->height();
+    const int width = tile->width();
     const int numPixels = width * height;
 
+    // Only whole-film renders report progress; tiles of a larger film are too numerous
+    const bool wholeFilm = (width == filmSize.x) && (height == filmSize.y);
+
     Array<Color3> modulationBuffer;
     Array<Ray> rayBuffer;
+    Array<float> coneAngleBuffer;
+    Array<float> coneWidthBuffer;
     Array<shared_ptr<Surfel>> surfelBuffer;
     Array<Biradiance3> biradianceBuffer;
     Array<Ray> shadowRayBuffer;
     Array<bool> lightShadowedBuffer;
+    Array<int> chosenLightBuffer;
+    Array<float> scatterPdfBuffer;
+    Array<Radiance3> emissiveRadianceBuffer;
+    Array<Ray> emissiveShadowRayBuffer;
+    Array<bool> emissiveShadowedBuffer;
+    Array<Radiance3> passRadianceBuffer;
+    Array<Radiance3> meanBuffer;
+    Array<float> luminanceM2Buffer;
 
     modulationBuffer.resize(numPixels);
     rayBuffer.resize(numPixels);
+    coneAngleBuffer.resize(numPixels);
+    coneWidthBuffer.resize(numPixels);
     surfelBuffer.resize(numPixels);
     biradianceBuffer.resize(numPixels);
     shadowRayBuffer.resize(numPixels);
     lightShadowedBuffer.resize(numPixels);
+    chosenLightBuffer.resize(numPixels);
+    scatterPdfBuffer.resize(numPixels);
+    passRadianceBuffer.resize(numPixels);
+    meanBuffer.resize(numPixels);
+    luminanceM2Buffer.resize(numPixels);
+    meanBuffer.setAll(Radiance3::zero());
+    luminanceM2Buffer.setAll(0.0f);
+
+    // Emissive triangle sampling needs its own shadow rays, so its buffers only exist when there is something to sample
+    const bool sampleEmissiveTris = m_sampleEmissiveTris && (m_emissiveTris.size() > 0);
+    if (sampleEmissiveTris) {
+        emissiveRadianceBuffer.resize(numPixels);
+        emissiveShadowRayBuffer.resize(numPixels);
+        emissiveShadowedBuffer.resize(numPixels);
+    }
+
+    const bool debugView = m_eyeRayTest || m_hitsTest || m_geoNormalsTest;
+    Array<Radiance3>* lightSums = nullptr;
+    if (notNull(cache) && m_keepLightContributions && !debugView) {
+        lightSums = &cache->lightSums;
+        lightSums->resize(lightArray.size() * numPixels);
+        lightSums->setAll(Radiance3::zero());
+    }
+
+    RenderStats stats;
+    const RealTime startTime = System::time();
 
     // Iterate over num rays per pixel
-    for (int i = 0; i < raysPerPixel; ++i) {
-        const String& caption = format("Iteration: %i of %i", i, raysPerPixel - 1);
-        debugPrintf("%s\n", caption.c_str());
+    for (int i = 0; i < budget.raysPerPixel; ++i) {
+        if (wholeFilm) {
+            const String& caption = format("Iteration: %i of %i", i, budget.raysPerPixel - 1);
+            debugPrintf("%s\n", caption.c_str());
+        }
 
         // Generate all rays
-        generateRays(rayBuffer, width, height, multithreading);
-        modulationBuffer.setAll(Color3(1.0f / (float)raysPerPixel));
+        generateRays(rayBuffer, coneAngleBuffer, tileOffset, width, height, filmSize, multithreading);
+        coneWidthBuffer.setAll(0.0f);
+        modulationBuffer.setAll(Color3(1.0f));
+        scatterPdfBuffer.setAll(0.0f);
+        passRadianceBuffer.setAll(Radiance3::zero());
 
         // Iterate over num scattering events
         for (int j = 0; j < scatteringEvents + 1; ++j) {
 
 
-            // Find intersected surfels
-            traceIntersections(rayBuffer, surfelBuffer, multithreading);
+            // Find intersected surfels. Eye rays are the same every pass, so their hits are traced once and then copied.
+            if ((j == 0) && notNull(cache) && (cache->primarySurfels.size() == numPixels)) {
+                surfelBuffer = cache->primarySurfels;
+            } else {
+                traceIntersections(tris, rayBuffer, coneAngleBuffer, coneWidthBuffer, surfelBuffer, multithreading);
+                if ((j == 0) && notNull(cache)) {
+                    cache->primarySurfels = surfelBuffer;
+                }
+            }
 
             // Get radiance from direct lights
             if (lightArray.size() > 0) {
                 // Get biradiance values and shadow rays from randomly chosen lights
-                chooseLights(lightArray, surfelBuffer, biradianceBuffer, shadowRayBuffer, multithreading);
+                chooseLights(lightArray, surfelBuffer, biradianceBuffer, shadowRayBuffer, chosenLightBuffer, multithreading);
 
                 // Test whether lights are actually visible
-                testVisibility(shadowRayBuffer, surfelBuffer, lightShadowedBuffer, multithreading);
+                testVisibility(tris, shadowRayBuffer, surfelBuffer, lightShadowedBuffer, multithreading);
+            } else {
+                // Emission is still written for scenes lit only by emissive geometry
+                lightShadowedBuffer.setAll(true);
+            }
 
-                writeToImage(image, biradianceBuffer, lightShadowedBuffer, shadowRayBuffer, surfelBuffer, rayBuffer, modulationBuffer, multithreading);
+            writeToImage(passRadianceBuffer, biradianceBuffer, lightShadowedBuffer, shadowRayBuffer, surfelBuffer, rayBuffer, modulationBuffer, scatterPdfBuffer, chosenLightBuffer, lightSums, multithreading);
+
+            // Get radiance from emissive triangles
+            if (sampleEmissiveTris) {
+                chooseEmissivePoints(rayBuffer, surfelBuffer, emissiveRadianceBuffer, emissiveShadowRayBuffer, j < scatteringEvents, multithreading);
+                testVisibility(tris, emissiveShadowRayBuffer, surfelBuffer, emissiveShadowedBuffer, multithreading);
+                writeEmissiveToImage(passRadianceBuffer, emissiveRadianceBuffer, emissiveShadowedBuffer, surfelBuffer, modulationBuffer, multithreading);
             }
 
             // Generate recursive rays and update modulationBuffer
-            generateRecursiveRays(rayBuffer, modulationBuffer, surfelBuffer, multithreading);
+            generateRecursiveRays(rayBuffer, modulationBuffer, coneAngleBuffer, coneWidthBuffer, scatterPdfBuffer, surfelBuffer, multithreading);
             //debugPrintf("%d raysPerPixel %d scatteringEvents",i,j);
         }
 
+        // Fold the pass into the running mean, tracking each pixel's luminance variance with Welford's update
+        const int passes = i + 1;
+        Thread::runConcurrently(G3D::Point2int32(0, 0), G3D::Point2int32(width, height), [&](G3D::Point2int32 coord) {
+            const int p = coord.y * width + coord.x;
+            const Radiance3& L = passRadianceBuffer[p];
+            const float oldMeanLuminance = meanBuffer[p].average();
+            meanBuffer[p] += (L - meanBuffer[p]) / float(passes);
+            luminanceM2Buffer[p] += (L.average() - oldMeanLuminance) * (L.average() - meanBuffer[p].average());
+            tile->set(coord, meanBuffer[p]);
+        }, !multithreading);
+
+        stats.raysPerPixel = passes;
+
+        if (wholeFilm && m_onPassComplete) {
+            m_onPassComplete(passes, budget.raysPerPixel);
+        }
+
+        if (notNull(m_cancel) && m_cancel->load()) {
+            // A partial image must not be relit later
+            lightSums = nullptr;
+            if (notNull(cache)) {
+                cache->lightSums.clear();
+            }
+            break;
+        }
+
+        if (budget.mode == RenderBudget::TIME_BUDGET) {
+            // Stop if another pass of average length would overrun the budget
+            const RealTime elapsed = System::time() - startTime;
+            if (elapsed * float(passes + 1) / float(passes) > budget.seconds) {
+                break;
+            }
+        } else if ((budget.mode == RenderBudget::NOISE_TARGET) && (passes >= max(2, budget.minPasses))) {
+            if (estimateRelativeError(meanBuffer, luminanceM2Buffer, passes) <= budget.targetError) {
+                break;
+            }
+        }
     }
-    stopWatch.tock();
+
+    stats.estimatedError = estimateRelativeError(meanBuffer, luminanceM2Buffer, stats.raysPerPixel);
+    stats.time = System::time() - startTime;
+
+    if (notNull(lightSums)) {
+        cache->image = meanBuffer;
+        cache->stats = stats;
+        cache->lights = lightArray;
+        cache->lightPowers.resize(lightArray.size());
+        cache->lightFrames.resize(lightArray.size());
+        cache->lightStates.resize(lightArray.size());
+        for (int j = 0; j < lightArray.size(); ++j) {
+            cache->lightPowers[j] = effectivePower(lightArray[j]);
+            cache->lightFrames[j] = lightArray[j]->frame();
+            cache->lightStates[j] = lightState(lightArray[j]);
+        }
+        cache->imageValid = true;
+    }
+    return stats;
 }
 
-void PathTracer::writeToImage(const shared_ptr<Image>& image, const Array<Biradiance3>& biradianceBuffer, const Array<bool>& lightShadowedBuffer, const Array<Ray>& shadowRayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, const bool& multithreading) const {
-    int height = image->height();
-    int width = image->width();
+float PathTracer::estimateRelativeError(const Array<Radiance3>& meanBuffer, const Array<float>& luminanceM2Buffer, int passes) {
+    if (passes < 2) {
+        return finf();
+    }
 
-    Thread::runConcurrently(G3D::Point2int32(0, 0), G3D::Point2int32(width, height), [&](G3D::Point2int32 coord) {
-        int i = coord.y * width + coord.x;
-        const Point2int32 pixel = Point2int32(coord.x, coord.y);
+    // The variance of a pixel's mean is its sample variance M2 / (n - 1) divided by n
+    double varianceOfMeanSum = 0.0;
+    double luminanceSum = 0.0;
+    for (int p = 0; p < meanBuffer.size(); ++p) {
+        varianceOfMeanSum += luminanceM2Buffer[p] / (double(passes) * double(passes - 1));
+        luminanceSum += meanBuffer[p].average();
+    }
+
+    if (luminanceSum <= 0.0) {
+        return 0.0f;
+    }
+
+    return float(sqrt(varianceOfMeanSum / meanBuffer.size()) / (luminanceSum / meanBuffer.size()));
+}
+
+void PathTracer::writeToImage(Array<Radiance3>& passRadianceBuffer, const Array<Biradiance3>& biradianceBuffer, const Array<bool>& lightShadowedBuffer, const Array<Ray>& shadowRayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, const Array<float>& scatterPdfBuffer, const Array<int>& chosenLightBuffer, Array<Radiance3>* lightSums, const bool& multithreading) const {
+    const int numPixels = passRadianceBuffer.size();
+    const bool weighEmission = m_sampleEmissiveTris && (m_emissiveTris.size() > 0);
+    const auto& emissionWeight = [&](const Ray& ray, const shared_ptr<Surfel>& surfel, const Radiance3& emitted, float scatterPdf) {
+        // Primary hits, hits through impulses (scatterPdf == 0) and emitters left out of m_emissiveTris can never be
+        // produced by emissive triangle sampling
+        if (! weighEmission || (scatterPdf <= 0.0f) || emitted.isZero() || ! sampledAsEmitter(surfel->material)) {
+            return 1.0f;
+        }
+        return powerHeuristic(scatterPdf, emissiveLightPdf(ray, surfel, emitted));
+    };
+
+    Thread::runConcurrently(0, passRadianceBuffer.size(), [&](int i) {
 
         if (m_eyeRayTest) {
             Vector3 r = rayBuffer[i].direction();
             Radiance3 radiance = Radiance3(r.x + 1, r.y + 1, r.z + 1) / 2.0f;
-            image->increment(pixel, radiance);
+            passRadianceBuffer[i] += radiance;
         }
         else if (m_hitsTest) {
             if (notNull(surfelBuffer[i])) {
                 Point3 p = surfelBuffer[i]->position;
                 Radiance3 radiance = Radiance3(p.x*0.3f + 0.5f, p.y*0.3f + 0.5f, p.z*0.3f + 0.5f);
-                image->increment(pixel, radiance);
+                passRadianceBuffer[i] += radiance;
             }
         }
         else if (m_geoNormalsTest) {
@@ -109,7 +674,7 @@ void PathTracer::writeToImage(const shared_ptr<Image>& image, const Array<Biradi
 
                 Point3 n = surfelBuffer[i]->geometricNormal;
                 Radiance3 radiance = Radiance3(n.x + 1, n.y + 1, n.z + 1) / 2.0f;
-                image->increment(pixel, radiance);
+                passRadianceBuffer[i] += radiance;
             }
         }
         else {
@@ -124,19 +689,25 @@ void PathTracer::writeToImage(const shared_ptr<Image>& image, const Array<Biradi
                     const Color3 f = surfelBuffer[i]->finiteScatteringDensity(w_i, w_o);
                     const Color3 mod = modulationBuffer[i];
 
-                    const Radiance3& emittedLight = surfelBuffer[i]->emittedRadiance(w_o) * mod;
+                    const Radiance3& emitted = surfelBuffer[i]->emittedRadiance(w_o);
+                    const Radiance3& emittedLight = emitted * mod * emissionWeight(rayBuffer[i], surfelBuffer[i], emitted, scatterPdfBuffer[i]);
 
-                    Radiance3 radiance = emittedLight + B * mod * f * abs(n.dot(w_i));
+                    const Radiance3& direct = B * mod * f * abs(n.dot(w_i));
+                    Radiance3 radiance = emittedLight + direct;
 
-                    image->increment(pixel, radiance);
+                    passRadianceBuffer[i] += radiance;
+                    if (notNull(lightSums)) {
+                        (*lightSums)[chosenLightBuffer[i] * numPixels + i] += direct;
+                    }
                 }
                 else {
                     const Vector3 w_o = rayBuffer[i].direction();
                     const Color3 mod = modulationBuffer[i];
 
-                    const Radiance3& emittedLight = surfelBuffer[i]->emittedRadiance(w_o) * mod;
+                    const Radiance3& emitted = surfelBuffer[i]->emittedRadiance(w_o);
+                    const Radiance3& emittedLight = emitted * mod * emissionWeight(rayBuffer[i], surfelBuffer[i], emitted, scatterPdfBuffer[i]);
 
-                    image->increment(pixel, emittedLight);
+                    passRadianceBuffer[i] += emittedLight;
                 }
             }
         }
@@ -144,7 +715,74 @@ void PathTracer::writeToImage(const shared_ptr<Image>& image, const Array<Biradi
 }
 
 
-void PathTracer::generateRecursiveRays(Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const {
+void PathTracer::writeEmissiveToImage(Array<Radiance3>& passRadianceBuffer, const Array<Radiance3>& emissiveRadianceBuffer, const Array<bool>& emissiveShadowedBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, const Array<Color3>& modulationBuffer, const bool& multithreading) const {
+    if (m_eyeRayTest || m_hitsTest || m_geoNormalsTest) {
+        return;
+    }
+
+    Thread::runConcurrently(0, passRadianceBuffer.size(), [&](int i) {
+        if (notNull(surfelBuffer[i]) && !emissiveShadowedBuffer[i]) {
+            passRadianceBuffer[i] += emissiveRadianceBuffer[i] * modulationBuffer[i];
+        }
+    }, !multithreading);
+}
+
+
+float PathTracer::emissiveLightPdf(const Ray& ray, const shared_ptr<Surfel>& surfel, const Radiance3& emittedRadiance) const {
+    // Area density of picking this point is (radiance * area / total power) / area, so the triangle's area cancels.
+    // Only called for uniform emitters, so the radiance at the point is the triangle's radiance.
+    const float cosLight = abs(surfel->geometricNormal.dot(ray.direction()));
+    if (cosLight <= 0.0f) {
+        return 0.0f;
+    }
+    const float distance2 = (surfel->position - ray.origin()).squaredLength();
+    return emittedRadiance.average() / m_totalEmissivePower * distance2 / cosLight;
+}
+
+
+void PathTracer::chooseEmissivePoints(const Array<Ray>& rayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Radiance3>& emissiveRadianceBuffer, Array<Ray>& emissiveShadowRayBuffer, bool misWeighted, const bool& multithreading) const {
+    Thread::runConcurrently(0, surfelBuffer.size(), [&](int i) {
+        const shared_ptr<Surfel>& surfel = surfelBuffer[i];
+        emissiveRadianceBuffer[i] = Radiance3::zero();
+
+        if (notNull(surfel)) {
+            Random& rng = Random::threadCommon();
+
+            // Pick a triangle in proportion to its power, then a uniform point on it
+            const int t = min(int(std::upper_bound(m_emissiveCDF.begin(), m_emissiveCDF.end(), rng.uniform()) - m_emissiveCDF.begin()), m_emissiveCDF.size() - 1);
+            const EmissiveTri& emitter = m_emissiveTris[t];
+            const float s = sqrt(rng.uniform());
+            const float r = rng.uniform();
+            const Point3& lightPoint = emitter.vertex[0] * (1.0f - s) + emitter.vertex[1] * (s * (1.0f - r)) + emitter.vertex[2] * (s * r);
+
+            const Vector3& surfelToLight = lightPoint - surfel->position;
+            const float distance = surfelToLight.length();
+            const Vector3& w_i = surfelToLight / distance;
+            const Vector3& w_o = -rayBuffer[i].direction();
+
+            const float cosLight = abs(emitter.normal.dot(w_i));
+            const float cosSurfel = abs(surfel->shadingNormal.dot(w_i));
+
+            // Bump toward the side the light is on; the shadow ray stops just short of the emitter itself
+            const Point3& bumpedPoint = surfel->position + (EPSILON * surfel->geometricNormal) * sign(surfel->geometricNormal.dot(w_i));
+            emissiveShadowRayBuffer[i] = Ray(bumpedPoint, w_i, 0.0f, distance * 0.999f);
+
+            if ((cosLight > 0.0f) && (distance > 0.0f)) {
+                const float selectionPdf = emitter.area * emitter.radiance.average() / m_totalEmissivePower;
+                const float lightPdf = selectionPdf / emitter.area * distance * distance / cosLight;
+
+                // Same cosine weighted density generateRecursiveRays records, so the two weights of a path sum to one
+                const float scatterPdf = cosSurfel / pif();
+
+                const Color3& f = surfel->finiteScatteringDensity(w_i, w_o);
+                emissiveRadianceBuffer[i] = emitter.radiance * f * cosSurfel / lightPdf * (misWeighted ? powerHeuristic(lightPdf, scatterPdf) : 1.0f);
+            }
+        }
+    }, !multithreading);
+}
+
+
+void PathTracer::generateRecursiveRays(Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, Array<float>& coneAngleBuffer, Array<float>& coneWidthBuffer, Array<float>& scatterPdfBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const {
     Thread::runConcurrently(0, rayBuffer.size(), [&](int i) {
         const shared_ptr<Surfel>& surfel = surfelBuffer[i];
         //YAAAAAK
@@ -153,7 +791,13 @@ void PathTracer::generateRecursiveRays(Array<Ray>& rayBuffer, Array<Color3>& mod
             const Vector3& w_o = -rayBuffer[i].direction();
             Vector3 w_i;
             Color3 weight;
-            surfel->scatter(PathDirection::EYE_TO_SOURCE, w_o, false, Random::threadCommon(), weight, w_i);
+            bool impulseScattered = false;
+            float probabilityHint = 0.0f;
+            surfel->scatter(PathDirection::EYE_TO_SOURCE, w_o, false, Random::threadCommon(), weight, w_i, impulseScattered, probabilityHint);
+
+            // Footprint width the cone has reached at this hit, carried into the next segment
+            const float distance = (surfel->position - rayBuffer[i].origin()).length();
+            coneWidthBuffer[i] += distance * tan(coneAngleBuffer[i]);
 
             // Calculated bumped point
             // Should directionIn be negated?
@@ -162,6 +806,20 @@ void PathTracer::generateRecursiveRays(Array<Ray>& rayBuffer, Array<Color3>& mod
             // Store recursive ray
             rayBuffer[i] = Ray(bumpedPoint, w_i);
 
+            // Impulses keep the cone and cannot be reproduced by light sampling. Other bounces spread the cone by roughly the
+            // angle of a cone holding the sampled lobe, i.e. one whose solid angle is 1 / density, so sharp glossy lobes
+            // barely widen it and Lambertian ones reach the cap.
+            if (! impulseScattered) {
+                const float lobeAngle = (probabilityHint > 0.0f) ? min(1.0f / sqrt(pif() * probabilityHint), DIFFUSE_CONE_ANGLE) : DIFFUSE_CONE_ANGLE;
+                coneAngleBuffer[i] = max(coneAngleBuffer[i], lobeAngle);
+
+                // MIS against emissive triangles only needs both strategies to use the same density for a path. The light
+                // sample cannot ask the surfel for the density of an arbitrary direction, so both use the cosine weighted one.
+                scatterPdfBuffer[i] = abs(surfel->shadingNormal.dot(w_i)) / pif();
+            } else {
+                scatterPdfBuffer[i] = 0.0f;
+            }
+
             // Store modulation?
             modulationBuffer[i] = weight * modulationBuffer[i];
         }
@@ -169,14 +827,23 @@ void PathTracer::generateRecursiveRays(Array<Ray>& rayBuffer, Array<Color3>& mod
 }
 
 
-void PathTracer::testVisibility(const Array<Ray>& shadowRayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<bool>& lightShadowedBuffer, const bool& multithreading) const {
-    m_tris.intersectRays(shadowRayBuffer, lightShadowedBuffer, TriTree::COHERENT_RAY_HINT | TriTree::DO_NOT_CULL_BACKFACES | TriTree::OCCLUSION_TEST_ONLY);
+void PathTracer::testVisibility(const TriTree& tris, const Array<Ray>& shadowRayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<bool>& lightShadowedBuffer, const bool& multithreading) const {
+    const TriTree::IntersectRayOptions options = TriTree::COHERENT_RAY_HINT | TriTree::DO_NOT_CULL_BACKFACES | TriTree::OCCLUSION_TEST_ONLY;
+    if (multithreading) {
+        tris.intersectRays(shadowRayBuffer, lightShadowedBuffer, options);
+    } else {
+        // The batch call always fans out over the global thread pool; stay on the calling (possibly pinned) thread
+        for (int i = 0; i < shadowRayBuffer.size(); ++i) {
+            TriTree::Hit hit;
+            lightShadowedBuffer[i] = tris.intersectRay(shadowRayBuffer[i], hit, options);
+        }
+    }
 }
 
 
 
 
-void PathTracer::chooseLights(const Array<shared_ptr<Light>>& lightArray, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Biradiance3>& biradianceBuffer, Array<Ray>& shadowRayBuffer, const bool& multithreading) const {
+void PathTracer::chooseLights(const Array<shared_ptr<Light>>& lightArray, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Biradiance3>& biradianceBuffer, Array<Ray>& shadowRayBuffer, Array<int>& chosenLightBuffer, const bool& multithreading) const {
 
     // Calculate biradiance from each light source
     Thread::runConcurrently(0, surfelBuffer.size(), [&](int i) {
@@ -207,6 +874,7 @@ void PathTracer::chooseLights(const Array<shared_ptr<Light>>& lightArray, const
                     }
                 }
                 light = lightArray[lightPos];
+                chosenLightBuffer[i] = lightPos;
 
             Biradiance3 biradiance;
             if (totalBiradiance==0.0f){
@@ -236,11 +904,18 @@ void PathTracer::chooseLights(const Array<shared_ptr<Light>>& lightArray, const
 }
 
 
-void PathTracer::generateRays(Array<Ray>& rayBuffer, const int& width, const int& height, const bool& multithreading) const {
+void PathTracer::generateRays(Array<Ray>& rayBuffer, Array<float>& coneAngleBuffer, const Point2int32& tileOffset, const int& width, const int& height, const Vector2int32& filmSize, const bool& multithreading) const {
+    const Rect2D& film = Rect2D(Vector2(float(filmSize.x), float(filmSize.y)));
+
+    // Angle between neighboring pixels at the center of the film; close enough everywhere for MIP selection
+    const Vector3& center = m_camera->worldRay(film.center().x, film.center().y, film).direction();
+    const Vector3& right = m_camera->worldRay(film.center().x + 1.0f, film.center().y, film).direction();
+    coneAngleBuffer.setAll(acos(clamp(center.dot(right), -1.0f, 1.0f)));
+
     Thread::runConcurrently(G3D::Point2int32(0, 0), G3D::Point2int32(width, height), [&](G3D::Point2int32 coord) {
         // TODO bump these around a bit
         //const float x_off = Random::threadCommon().integer();
-        Ray ray = m_camera->worldRay(coord.x, coord.y, Rect2D(Vector2(width, height)));
+        Ray ray = m_camera->worldRay(float(coord.x + tileOffset.x), float(coord.y + tileOffset.y), film);
         
         rayBuffer[width * coord.y + coord.x] = ray;
     }, !multithreading);
@@ -248,8 +923,31 @@ void PathTracer::generateRays(Array<Ray>& rayBuffer, const int& width, const int
 
 
 
-void PathTracer::traceIntersections(const Array<Ray>& rayBuffer, Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const {
-    // Find intersections
-    m_tris.intersectRays(rayBuffer, surfelBuffer, TriTree::COHERENT_RAY_HINT);
+void PathTracer::traceIntersections(const TriTree& tris, const Array<Ray>& rayBuffer, const Array<float>& coneAngleBuffer, const Array<float>& coneWidthBuffer, Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const {
+    // Find intersections. The cone angles make the surfels sample textures at the MIP level of the ray's footprint.
+    // The tree measures a cone from the ray origin, so a cone that is already wide there is traced from its apex
+    // behind the origin, with the segment before the real origin excluded by the ray's minimum distance.
+    Array<Ray> coneRays;
+    const Array<Ray>* rays = &rayBuffer;
+    if (m_rayCones && (coneWidthBuffer.size() == rayBuffer.size())) {
+        coneRays.resize(rayBuffer.size());
+        Thread::runConcurrently(0, rayBuffer.size(), [&](int i) {
+            const Ray& ray = rayBuffer[i];
+            const float apexDistance = (coneAngleBuffer[i] > 0.0f) ? coneWidthBuffer[i] / tan(coneAngleBuffer[i]) : 0.0f;
+            coneRays[i] = Ray(ray.origin() - ray.direction() * apexDistance, ray.direction(), ray.minDistance() + apexDistance, ray.maxDistance() + apexDistance);
+        }, !multithreading);
+        rays = &coneRays;
+    }
+
+    if (! multithreading) {
+        // Traversal and surfel allocation stay on the calling thread, which keeps NUMA workers on their own node
+        for (int i = 0; i < rays->size(); ++i) {
+            surfelBuffer[i] = tris.intersectRay((*rays)[i], TriTree::COHERENT_RAY_HINT, m_rayCones ? coneAngleBuffer[i] : 0.0f);
+        }
+    } else if (m_rayCones) {
+        tris.intersectRays(*rays, surfelBuffer, TriTree::COHERENT_RAY_HINT, coneAngleBuffer);
+    } else {
+        tris.intersectRays(rayBuffer, surfelBuffer, TriTree::COHERENT_RAY_HINT);
+    }
 }
 
@@ -1,5 +1,72 @@
 #pragma once
 #include <G3D/G3DAll.h>
+#include <atomic>
+#include <functional>
+#include "NumaTopology.h"
+
+/** When PathTracer::renderScene stops taking passes. Every mode stops cleanly between passes. */
+class RenderBudget {
+public:
+    enum Mode {
+        /** Exactly raysPerPixel passes */
+        FIXED_SAMPLES,
+        /** As many passes as fit in seconds of wall-clock time */
+        TIME_BUDGET,
+        /** Passes until the estimated relative error of the image drops to targetError */
+        NOISE_TARGET
+    };
+
+    Mode mode = FIXED_SAMPLES;
+
+    /** Passes taken in FIXED_SAMPLES mode, and the most the other modes may take */
+    int raysPerPixel = 1;
+
+    RealTime seconds = 0;
+
+    /** RMS standard error of the per-pixel mean luminance, relative to the mean luminance of the image */
+    float targetError = 0.02f;
+
+    /** Passes NOISE_TARGET takes before trusting its variance estimate */
+    int minPasses = 4;
+
+    bool operator==(const RenderBudget& other) const {
+        return (mode == other.mode) && (raysPerPixel == other.raysPerPixel) && (seconds == other.seconds) &&
+            (targetError == other.targetError) && (minPasses == other.minPasses);
+    }
+
+    static RenderBudget fixedSamples(int raysPerPixel) {
+        RenderBudget b;
+        b.raysPerPixel = raysPerPixel;
+        return b;
+    }
+
+    static RenderBudget timeLimit(RealTime seconds, int maxRaysPerPixel = 1 << 20) {
+        RenderBudget b;
+        b.mode = TIME_BUDGET;
+        b.seconds = seconds;
+        b.raysPerPixel = maxRaysPerPixel;
+        return b;
+    }
+
+    static RenderBudget noiseTarget(float targetError, int maxRaysPerPixel = 1 << 20) {
+        RenderBudget b;
+        b.mode = NOISE_TARGET;
+        b.targetError = targetError;
+        b.raysPerPixel = maxRaysPerPixel;
+        return b;
+    }
+};
+
+/** What a render achieved */
+class RenderStats {
+public:
+    int raysPerPixel = 0;
+
+    /** Same measure as RenderBudget::targetError; infinite with fewer than two passes */
+    float estimatedError = finf();
+
+    RealTime time = 0;
+};
 
 /**
     Performs ray tracing on the given ray, looking through all surfaces in the scene.
@@ -11,11 +78,123 @@ protected:
     /** Handling for float precision and ray bump */
     const float EPSILON = 0.0001f;
 
+    /** Widest cone spread angle in radians a bounce can add, reached by Lambertian bounces. Glossy bounces add
+        the angle of their sampled lobe, which shrinks as the lobe sharpens, and impulses add nothing. */
+    const float DIFFUSE_CONE_ANGLE = 0.25f;
+
     /** TriTree used to iterate through all triangles in the scene */
     TriTree m_tris;
+
+    /** Posed surfaces the tree was built from, kept so per-node copies of the tree can be built */
+    Array<shared_ptr<Surface>> m_surfaces;
+
+    /** Copies of m_tris built by renderSceneNuma with replicateTree, one per node, each on its own node.
+        Kept until setScene rebuilds m_tris, or a topology with a different node count asks for copies. */
+    Array<shared_ptr<TriTree>> m_nodeTris;
+
     shared_ptr<Scene> m_scene;
     shared_ptr<Camera> m_camera;
-    //Array<shared_ptr<Light>> lights;
+
+    /** Lights gathered in setScene, so a render on another thread never walks the live scene */
+    Array<shared_ptr<Light>> m_lights;
+
+    /** A triangle of emissive geometry, sampled directly as an area light */
+    class EmissiveTri {
+    public:
+        Point3      vertex[3];
+        Vector3     normal;
+        float       area;
+
+        /** The material's emitted radiance, which is the same everywhere on the triangle */
+        Radiance3   radiance;
+    };
+
+    /** Every triangle of the posed surfaces with uniform emission, built in setScene. Textured emitters are left
+        out, since sampling them by their mean would not match the texel a path actually hits; paths still find
+        them by BSDF sampling, with full weight. */
+    Array<EmissiveTri> m_emissiveTris;
+
+    /** True if material is one whose triangles go in m_emissiveTris: a UniversalMaterial with constant, nonzero emission */
+    static bool sampledAsEmitter(const Material* material);
+
+    /** Cumulative share of the total emitted power up to and including each of m_emissiveTris; the last entry is 1 */
+    Array<float> m_emissiveCDF;
+
+    /** Sum of area * radiance.average() over m_emissiveTris */
+    float m_totalEmissivePower = 0.0f;
+
+    /** Scene::lastStructuralChangeTime() when the tree was built */
+    RealTime m_lastStructuralChangeTime = 0;
+
+    /** materialState of m_surfaces when the emissive triangles were built and m_cache was filled; empty if unknown */
+    String m_materialState;
+
+    /** What the last whole-film render left behind for an incremental re-render. Everything here was computed
+        for one camera and film size; the tree is reused separately by setScene. */
+    class RenderCache {
+    public:
+        CFrame              cameraFrame;
+        float               fieldOfView = 0.0f;
+        Vector2int32        filmSize;
+        bool                rayCones = false;
+
+        /** First hit of every pixel. Eye rays go through fixed pixel positions, so these are the same every pass. */
+        Array<shared_ptr<Surfel>> primarySurfels;
+
+        /** Settings the image below was rendered with */
+        int                 scatteringEvents = 0;
+        RenderBudget        budget;
+        bool                sampleEmissiveTris = false;
+
+        /** True once a render with the settings above finished without being cancelled */
+        bool                imageValid = false;
+        Array<Radiance3>    image;
+        RenderStats         stats;
+
+        /** Sum over all passes of the light sampling contributions of each of m_lights, light-major.
+            The part of image lit by light j scales exactly with its power, so changing it is a rescale. */
+        Array<Radiance3>    lightSums;
+        Array<shared_ptr<Light>> lights;
+        Array<Power3>       lightPowers;
+        Array<CFrame>       lightFrames;
+
+        /** lightState of each of lights, which must be unchanged for a relight */
+        Array<String>       lightStates;
+    };
+
+    RenderCache m_cache;
+
+    /** True if surfaces match m_surfaces by name, frame and material, so the tree can be kept */
+    bool sameGeometry(const Array<shared_ptr<Surface>>& surfaces) const;
+
+    /** Hashes the CPU vertices and indices of surfaces into hash, so geometry deformed in place (skinned or posed
+        parts, edited heightfields) is caught even though its frame did not change. Returns false if some surface
+        has no CPU geometry to check, in which case the tree must be rebuilt. */
+    static bool hashGeometry(const Array<shared_ptr<Surface>>& surfaces, uint32& hash);
+
+    /** hashGeometry of m_surfaces when m_tris was built */
+    uint32 m_geometryHash = 0;
+
+    /** Power of light as it contributes to the image */
+    static Power3 effectivePower(const shared_ptr<Light>& light);
+
+    /** Every setting of light other than its power and whether it is enabled, i.e. everything a relight cannot
+        rescale: type, spot angles, attenuation, shadowing and so on. Empty if the light cannot describe itself. */
+    static String lightState(const shared_ptr<Light>& light);
+
+    /** Everything the surfels of surfaces sample from their materials: factors, means and textures of every
+        component and the indices of refraction. Empty if any surface has a material this cannot describe, in
+        which case nothing cached from it may be reused. Textures are identified by object, so texels rewritten
+        into an existing texture are not seen. */
+    static String materialState(const Array<shared_ptr<Surface>>& surfaces);
+
+    /** If m_cache.image can be brought up to date by rescaling each light's contribution, fills scale and returns true.
+        That is the case when the same lights are in the same places with the same settings and only their power,
+        color or enabled state changed. */
+    bool relightScales(Array<Color3>& scale) const;
+
+    /** Rescales m_cache's light contributions by scale, updates the cached image and writes it to image */
+    void relight(const shared_ptr<Image>& image, const Array<Color3>& scale, bool multithreading);
 
     RealTime m_lastTreeBuildTime;
 
@@ -33,34 +212,48 @@ protected:
 
         /***
        Pre: Scene and image size
-       Post: rayBuffer will be filled with one ray for each pixel in the image
+       Post: rayBuffer will be filled with one ray for each pixel in the width x height tile at tileOffset of a filmSize film,
+             and coneAngleBuffer with the angle one pixel subtends
     */
-    void PathTracer::generateRays(Array<Ray>& rayBuffer, const int& width, const int& height, const bool& multithreading) const;
+    void PathTracer::generateRays(Array<Ray>& rayBuffer, Array<float>& coneAngleBuffer, const Point2int32& tileOffset, const int& width, const int& height, const Vector2int32& filmSize, const bool& multithreading) const;
 
 
      /***
        Pre: Filled rayBuffer and image size
-       Post: surfelBuffer will have one intersected surfel for each pixel
+       Post: surfelBuffer will have one intersected surfel for each pixel, textured at the MIP level of each ray's cone.
+             A cone starts coneWidthBuffer wide at the ray origin and spreads by its coneAngleBuffer angle.
     */
-    void traceIntersections(const Array<Ray>& rayBuffer, Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const;
+    void traceIntersections(const TriTree& tris, const Array<Ray>& rayBuffer, const Array<float>& coneAngleBuffer, const Array<float>& coneWidthBuffer, Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const;
 
      /***
        Pre: Filled lightArray, filled surfelBuffer and image size
-       Post: biradianceBuffer filled for each pixel, shadowRayBuffer filled for each pixel
+       Post: biradianceBuffer filled for each pixel, shadowRayBuffer filled for each pixel, chosenLightBuffer holds the index of the light chosen
+    */
+    void chooseLights(const Array<shared_ptr<Light>>& lightArray, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Biradiance3>& biradianceBuffer, Array<Ray>& shadowRayBuffer, Array<int>& chosenLightBuffer, const bool& multithreading) const;
+
+    /***
+       Pre: Filled rayBuffer, filled surfelBuffer, non-empty m_emissiveTris
+       Post: For each pixel one point on an emissive triangle chosen by power. emissiveRadianceBuffer holds its
+             unshadowed contribution and emissiveShadowRayBuffer the ray to test it. The contribution is MIS weighted
+             against BSDF sampling only if misWeighted; at the last bounce no continuation ray is traced to find the
+             emitter, so the light sample must carry full weight.
     */
-    void chooseLights(const Array<shared_ptr<Light>>& lightArray, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Biradiance3>& biradianceBuffer, Array<Ray>& shadowRayBuffer, const bool& multithreading) const;
+    void chooseEmissivePoints(const Array<Ray>& rayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Radiance3>& emissiveRadianceBuffer, Array<Ray>& emissiveShadowRayBuffer, bool misWeighted, const bool& multithreading) const;
 
     /***
        Pre: Filled shadowRayBuffer, filled surfelBuffer
        Post: lightShadowedBuffer contaning whether light is visible for each pixel
     */
-    void testVisibility(const Array<Ray>& shadowRayBuffer,  const Array<shared_ptr<Surfel>>& surfelBuffer, Array<bool>& lightShadowedBuffer, const bool& multithreading) const;
+    void testVisibility(const TriTree& tris, const Array<Ray>& shadowRayBuffer,  const Array<shared_ptr<Surfel>>& surfelBuffer, Array<bool>& lightShadowedBuffer, const bool& multithreading) const;
     
      /***
        Pre: Filled rayBuffer, and filled surfelBuffer
-       Post: filled rayBuffer with one recursive ray for each pixel, and updated modulationBuffer
+       Post: filled rayBuffer with one recursive ray for each pixel, and updated modulationBuffer, coneAngleBuffer and
+             coneWidthBuffer, which carries the footprint width reached at the bounce into the next segment.
+             scatterPdfBuffer holds the density used to MIS weight emission found by the new ray, or 0 if the
+             bounce was an impulse (mirror or refraction), which light sampling cannot reproduce.
     */
-    void generateRecursiveRays(Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const;
+    void generateRecursiveRays(Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, Array<float>& coneAngleBuffer, Array<float>& coneWidthBuffer, Array<float>& scatterPdfBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, const bool& multithreading) const;
 
      /***
        Pre: Filled rayBuffer, filled surfelBuffer
@@ -70,9 +263,38 @@ protected:
 
     /***
        Pre: Filled rayBuffer, filled biradianceBuffer, filled lightShadowedBuffer
-       Post: Weighted biradiance data added to each pixel
+       Post: Weighted biradiance data added to each pixel of passRadianceBuffer. Emission found by BSDF sampling is MIS
+             weighted against emissive triangle sampling using scatterPdfBuffer. If lightSums is not null the direct
+             light part is also added to the chosen light's entry of it.
+    */
+    void writeToImage(Array<Radiance3>& passRadianceBuffer, const Array<Biradiance3>& biradianceBuffer, const Array<bool>& lightShadowedBuffer, const Array<Ray>& shadowRayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, const Array<float>& scatterPdfBuffer, const Array<int>& chosenLightBuffer, Array<Radiance3>* lightSums, const bool& multithreading) const;
+
+    /***
+       Pre: Filled emissiveRadianceBuffer, filled emissiveShadowedBuffer
+       Post: Modulated contribution of each visible emissive sample added to each pixel of passRadianceBuffer
+    */
+    void writeEmissiveToImage(Array<Radiance3>& passRadianceBuffer, const Array<Radiance3>& emissiveRadianceBuffer, const Array<bool>& emissiveShadowedBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, const Array<Color3>& modulationBuffer, const bool& multithreading) const;
+
+    /** Solid angle density with which chooseEmissivePoints would pick the point seen along ray at surfel */
+    float emissiveLightPdf(const Ray& ray, const shared_ptr<Surfel>& surfel, const Radiance3& emittedRadiance) const;
+
+    /** Power heuristic MIS weight for a sample drawn with density pdf against another strategy with density otherPdf */
+    static float powerHeuristic(float pdf, float otherPdf) {
+        return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf);
+    }
+
+    /** Fills m_emissiveTris and m_emissiveCDF from m_tris */
+    void buildEmissiveTris();
+
+    /***
+       Pre: Camera set, tile is a subregion of a filmSize film whose upper left corner is tileOffset
+       Post: Passes taken until budget is met and the mean radiance of each pixel written to tile. Working buffers only span the tile.
+             If cache is not null, primary hits are read from or stored in it and the finished image and per-light sums kept there.
     */
-    void writeToImage(const shared_ptr<Image>& image, const Array<Biradiance3>& biradianceBuffer, const Array<bool>& lightShadowedBuffer, const Array<Ray>& shadowRayBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Ray>& rayBuffer, Array<Color3>& modulationBuffer, const bool& multithreading) const;
+    RenderStats renderTile(const TriTree& tris, const shared_ptr<Image>& tile, const Point2int32& tileOffset, const Vector2int32& filmSize, const RenderBudget& budget, bool multithreading, int scatteringEvents, RenderCache* cache = nullptr);
+
+    /** Relative RMS standard error of the per-pixel means, from the luminance sums of squared differences of passes passes */
+    static float estimateRelativeError(const Array<Radiance3>& meanBuffer, const Array<float>& luminanceM2Buffer, int passes);
 
 
 public:
@@ -80,16 +302,69 @@ public:
       bool m_eyeRayTest = false;
       bool m_hitsTest = false;
       bool m_geoNormalsTest = false;
+
+      /** Carry a cone footprint with every ray and use it to pick texture MIP levels. When false every
+          texture fetch reads the full resolution level. */
+      bool m_rayCones = true;
+
+      /** Send shadow rays to emissive triangles as well as to Light entities. When false emissive geometry only
+          contributes when a path happens to hit it. */
+      bool m_sampleEmissiveTris = true;
+
+      /** Keep per-light contribution sums from whole-film renders so that light power and color edits can be
+          applied by rescaling instead of re-rendering. Costs one radiance buffer per light. */
+      bool m_keepLightContributions = false;
+
+      /** If set, called on the rendering thread after each pass of renderScene with (passes done, most passes the
+          budget allows). After k passes the image holds the mean of those k passes. */
+      std::function<void(int, int)> m_onPassComplete;
+
+      /** If set, called by renderSceneNuma after each tile and by renderSceneToFile after each band with (pieces done,
+          total pieces). renderSceneNuma calls it from several worker threads at once. */
+      std::function<void(int, int)> m_onTileComplete;
+
+      /** If set and true, rendering stops cleanly after the current pass; renderSceneNuma and renderSceneToFile also
+          stop handing out tiles and bands. Owned by the caller. */
+      const std::atomic<bool>* m_cancel = nullptr;
       
 
     /** Constructor */
     PathTracer(shared_ptr<Scene> scene = nullptr);
 
+    /** Poses the scene and rebuilds the tree, unless the posed geometry is unchanged since the last call,
+        in which case only the lights are gathered again and cached render results stay usable. Cached hits and
+        images are dropped if any material changed, including in place, or if that cannot be determined. */
     void setScene(shared_ptr<Scene> scene);
+
+    const shared_ptr<Scene>& scene() const {
+        return m_scene;
+    }
+
+    /** Seconds spent posing the scene and building the tree in the last setScene */
+    RealTime lastTreeBuildTime() const {
+        return m_lastTreeBuildTime;
+    }
     
 
     void renderScene(const shared_ptr<Image>& image, Stopwatch& stopWatch, int raysPerPixel = 1, bool multithreading = true, int scatteringEvents = 0, shared_ptr<Camera> camera=NULL);
 
+    /** Renders until budget is met and reports the passes taken and the estimated error of the result */
+    RenderStats renderScene(const shared_ptr<Image>& image, Stopwatch& stopWatch, const RenderBudget& budget, bool multithreading = true, int scatteringEvents = 0, shared_ptr<Camera> camera=NULL);
+
+    /** Out-of-core render for films too large to hold in memory. The film is rendered in bands of bandHeight rows
+        which are streamed to filename as a PFM (scanline RGB32F) image as soon as they finish, so only one band
+        of radiance and working buffers is ever resident. Throws a String if the file cannot be opened or a write fails
+        (e.g. the disk fills up), after removing the partial file. Returns false, also removing the partial file,
+        if cancelled through m_cancel. */
+    bool renderSceneToFile(const String& filename, int width, int height, Stopwatch& stopWatch, int raysPerPixel = 1, bool multithreading = true, int scatteringEvents = 0, shared_ptr<Camera> camera=NULL, int bandHeight = 64);
+
+    /** NUMA-aware render. The image is split into one band of rows per node, sized by the node's processor count.
+        Each node gets worker threads pinned to its processors that pull tileSize x tileSize tiles from the node's
+        band, so every tile's working buffers are allocated and first touched on the node that uses them.
+        If replicateTree is true each node also traces against its own copy of the tree, built on that node the first
+        time it is needed after the geometry changes and included in the stopWatch time of that render. */
+    void renderSceneNuma(const shared_ptr<Image>& image, Stopwatch& stopWatch, const NumaTopology& topology, int raysPerPixel = 1, int scatteringEvents = 0, shared_ptr<Camera> camera=NULL, bool replicateTree = false, int tileSize = 32);
+
 
 
      /** Main ray tracing method. Finds radiance along ray coming from first intersecting object (looped over).
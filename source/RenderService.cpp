@@ -0,0 +1,184 @@
+#include "RenderService.h"
+#include <iostream>
+#include <string>
+#include <thread>
+
+
+RenderService::RenderService(const shared_ptr<AmbientOcclusion>& ambientOcclusion) : m_ambientOcclusion(ambientOcclusion) {
+}
+
+void RenderService::writeResult(const String& json) {
+    // Flushed per line so the client sees each result as soon as its job finishes
+    std::cout << json.c_str() << std::endl;
+}
+
+String RenderService::jsonString(const String& s) {
+    String result = "\"";
+    for (size_t i = 0; i < s.size(); ++i) {
+        const char c = s[i];
+        switch (c) {
+        case '"':  result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\n': result += "\\n"; break;
+        case '\r': result += "\\r"; break;
+        case '\t': result += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                result += format("\\u%04x", int(c));
+            } else {
+                result += c;
+            }
+        }
+    }
+    return result + "\"";
+}
+
+void RenderService::readJobs() {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        const String& text = trimWhitespace(String(line.c_str()));
+        if (text.empty()) {
+            continue;
+        }
+
+        Job job;
+        job.submitTime = System::time();
+        try {
+            Any any;
+            any.parse(text);
+            AnyTableReader reader(any);
+            reader.get("scene", job.scene);
+            reader.get("output", job.output);
+            reader.getIfPresent("camera", job.camera);
+            reader.getIfPresent("width", job.width);
+            reader.getIfPresent("height", job.height);
+            job.hasRaysPerPixel = reader.getIfPresent("raysPerPixel", job.raysPerPixel);
+            reader.getIfPresent("seconds", job.seconds);
+            reader.getIfPresent("targetError", job.targetError);
+            reader.getIfPresent("scatteringEvents", job.scatteringEvents);
+            reader.getIfPresent("priority", job.priority);
+            if (! reader.getIfPresent("id", job.id)) {
+                job.id = -1;
+            }
+        } catch (const ParseError& e) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            writeResult(format("{ \"error\": %s }", jsonString(e.message).c_str()));
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (job.id < 0) {
+            job.id = m_nextId;
+        }
+        m_nextId = max(m_nextId, job.id) + 1;
+        m_queue.append(job);
+        m_jobAdded.notify_one();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_inputClosed = true;
+    m_jobAdded.notify_one();
+}
+
+RenderService::Job RenderService::popNextJob() {
+    int best = 0;
+    for (int i = 1; i < m_queue.size(); ++i) {
+        // Ties go to the job that was submitted first
+        if (m_queue[i].priority > m_queue[best].priority) {
+            best = i;
+        }
+    }
+    const Job job = m_queue[best];
+    m_queue.remove(best);
+    return job;
+}
+
+shared_ptr<PathTracer> RenderService::tracerForScene(const String& sceneName, RealTime& loadTime) {
+    shared_ptr<PathTracer>* cached = m_tracers.getPointer(sceneName);
+    if (notNull(cached)) {
+        loadTime = 0;
+        return *cached;
+    }
+
+    const RealTime start = System::time();
+    const shared_ptr<Scene>& scene = Scene::create(m_ambientOcclusion);
+    scene->load(sceneName);
+    loadTime = System::time() - start;
+
+    const shared_ptr<PathTracer>& tracer = std::make_shared<PathTracer>(scene);
+    m_tracers.set(sceneName, tracer);
+    return tracer;
+}
+
+void RenderService::runJob(const Job& job) {
+    const RealTime queueTime = System::time() - job.submitTime;
+
+    String error;
+    RealTime loadTime = 0;
+    RealTime treeBuildTime = 0;
+    Stopwatch stopWatch;
+    RenderStats stats;
+    try {
+        const bool cached = m_tracers.containsKey(job.scene);
+        const shared_ptr<PathTracer>& tracer = tracerForScene(job.scene, loadTime);
+        if (! cached) {
+            treeBuildTime = tracer->lastTreeBuildTime();
+        }
+
+        const shared_ptr<Scene>& scene = tracer->scene();
+        const shared_ptr<Camera>& camera = job.camera.empty() ? scene->defaultCamera() : scene->typedEntity<Camera>(job.camera);
+        if (isNull(camera)) {
+            throw String("No camera named " + job.camera);
+        }
+
+        const shared_ptr<Image>& image = Image::create(job.width, job.height, ImageFormat::RGB32F());
+        RenderBudget budget = RenderBudget::fixedSamples(job.raysPerPixel);
+        // A time or noise goal alone must not be capped by the one pass raysPerPixel defaults to
+        if (job.seconds > 0) {
+            budget = job.hasRaysPerPixel ? RenderBudget::timeLimit(job.seconds, job.raysPerPixel) : RenderBudget::timeLimit(job.seconds);
+        } else if (job.targetError > 0) {
+            budget = job.hasRaysPerPixel ? RenderBudget::noiseTarget(job.targetError, job.raysPerPixel) : RenderBudget::noiseTarget(job.targetError);
+        }
+        stats = tracer->renderScene(image, stopWatch, budget, true, job.scatteringEvents, camera);
+
+        const String& extension = toLower(FilePath::ext(job.output));
+        if ((extension != "pfm") && (extension != "exr")) {
+            image->convert(ImageFormat::RGB8());
+        }
+        image->save(job.output);
+    } catch (const String& e) {
+        error = e;
+    } catch (const ParseError& e) {
+        error = e.message;
+    } catch (...) {
+        error = "Unable to render " + job.output;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (error.empty()) {
+        writeResult(format("{ \"id\": %d, \"output\": %s, \"queueTime\": %f, \"sceneLoadTime\": %f, \"treeBuildTime\": %f, \"renderTime\": %f, \"raysPerPixel\": %d, \"estimatedError\": %f }",
+            job.id, jsonString(job.output).c_str(), queueTime, loadTime, treeBuildTime, stopWatch.elapsedTime(), stats.raysPerPixel,
+            isFinite(stats.estimatedError) ? stats.estimatedError : -1.0f));
+    } else {
+        writeResult(format("{ \"id\": %d, \"error\": %s }", job.id, jsonString(error).c_str()));
+    }
+}
+
+void RenderService::run() {
+    std::thread reader([this]() { readJobs(); });
+
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_jobAdded.wait(lock, [this]() { return (m_queue.size() > 0) || m_inputClosed; });
+            if (m_queue.size() == 0) {
+                break;
+            }
+            job = popNextJob();
+        }
+        runJob(job);
+    }
+
+    reader.join();
+}
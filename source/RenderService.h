@@ -0,0 +1,76 @@
+#pragma once
+#include <G3D/G3DAll.h>
+#include <condition_variable>
+#include <mutex>
+#include "PathTracer.h"
+
+/**
+    Long-lived render daemon. Reads one render job per line from stdin, keeps every scene it has loaded
+    resident together with its PathTracer (and therefore its tree), and runs queued jobs highest priority
+    first, each using the whole thread pool. One result line is written to stdout per job.
+
+    A job is a JSON object, e.g.
+    \verbatim
+    { "id": 7, "scene": "G3D Sponza", "camera": "camera", "width": 640, "height": 400,
+      "raysPerPixel": 64, "scatteringEvents": 2, "priority": 1, "output": "sponza.png" }
+    \endverbatim
+    Only "scene" and "output" are required. Adding "seconds" or "targetError" renders to that time or noise
+    goal instead, with "raysPerPixel" as the cap if it is given and RenderBudget's default cap otherwise. "camera" names a Camera entity; the scene's default camera is
+    used otherwise. Outputs ending in .pfm or .exr are saved as RGB32F, anything else as RGB8.
+*/
+
+class RenderService {
+protected:
+
+    struct Job {
+        int         id = 0;
+        String      scene;
+        String      camera;
+        int         width = 320;
+        int         height = 200;
+        int         raysPerPixel = 1;
+        /** False when the job left raysPerPixel at its default */
+        bool        hasRaysPerPixel = false;
+        RealTime    seconds = 0;
+        float       targetError = 0;
+        int         scatteringEvents = 0;
+        int         priority = 0;
+        String      output;
+        RealTime    submitTime = 0;
+    };
+
+    shared_ptr<AmbientOcclusion> m_ambientOcclusion;
+
+    /** Loaded scenes by name, each with the tracer built over it */
+    Table<String, shared_ptr<PathTracer>> m_tracers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_jobAdded;
+    Array<Job> m_queue;
+    bool m_inputClosed = false;
+    int m_nextId = 1;
+
+    /** Runs on its own thread so jobs can be queued while others render */
+    void readJobs();
+
+    /** Pre: m_mutex held and m_queue not empty. Removes and returns the highest priority, oldest job */
+    Job popNextJob();
+
+    /** Returns the cached tracer for the scene, loading the scene and building its tree on first use */
+    shared_ptr<PathTracer> tracerForScene(const String& sceneName, RealTime& loadTime);
+
+    void runJob(const Job& job);
+
+    /** Writes one line to stdout. Pre: m_mutex held, since the reader thread also reports malformed jobs */
+    static void writeResult(const String& json);
+
+    /** Returns s as a quoted JSON string, escaping quotes, backslashes (e.g. in Windows paths) and control characters */
+    static String jsonString(const String& s);
+
+public:
+
+    RenderService(const shared_ptr<AmbientOcclusion>& ambientOcclusion);
+
+    /** Serves jobs until stdin is closed and the queue has drained. Must be called on the thread that owns the GL context. */
+    void run();
+};